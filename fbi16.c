@@ -6,9 +6,37 @@
 	license BSD
 
 	compile:
-		gcc fbi16.c -o fbi16.bin
+		gcc -O2 -pthread fbi16.c fbi16_common.c -o fbi16.bin -lz
+	or (zstd support):
+		gcc -O2 -pthread -DHAVE_ZSTD fbi16.c fbi16_common.c -o fbi16.bin -lz -lzstd
 
 Changelog:
+	18.10.2026
+		- packed pixels framebuffers (8, 16 and 32 bpp)
+		- daemon mode controlled through UNIX socket, cache of
+		  decoded images
+		- Otsu, Sauvola and Bradley binarization (parallel), honour
+		  maxval
+		- read file in separate thread
+		- image is updated in sync with vertical retrace
+		- double buffering (packed pixels framebuffers)
+		- graphics session (-g): console stays in graphics mode,
+		  screen is saved on VT switch and restored on return
+		- several framebuffers (-f) showing one image, each drawn
+		  by own thread
+		- read gzip & zstd compressed files (parts of file are
+		  decompressed in parallel)
+		- rotation & mirroring (-r, keys), done on packed bits
+		- threshold can be changed live (-k keeps source), visible
+		  rows are binarized at once, others when they are shown
+		- image storage: one arena per image (huge pages for large
+		  ones), cache limit is kept also at peak
+		- batch conversion to PBM (-b) on work-stealing thread pool,
+		  PBM files are displayed without binarization
+		- key traces: record (-T) and replay (-R) with latency report,
+		  replay runs without terminal
+		- input, image storage, rotations and batch pool shared with
+		  fbi16_2 (fbi16_common.c)
 	15.10.2006
 		- center images
 		- do not panic if open in virtual terminal
@@ -34,28 +62,112 @@ Changelog:
 #include <unistd.h>
 #include <termios.h>
 #include <signal.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/io.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <linux/fb.h>
 #include <linux/kd.h>
 #include <linux/vt.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 
 #define _SETMODE
 
-typedef char bool;
-#define false 0
-#define true  1
+#define INPUT_STATUS_1	0x3da
+
+#include "fbi16_common.h"
 
 #include <errno.h>
 extern int errno;
 
-uint8_t *screen;		/* framebuffer memory */
-int      screen_size;	/* in bytes */
+/* vertical retrace */
+enum {
+	VSYNC_NONE,
+	VSYNC_IOCTL,		/* FBIO_WAITFORVSYNC */
+	VSYNC_PORT			/* polling VGA input status register (root) */
+};
+
+/* framebuffer device (display head); several heads form a wall -- they
+   are placed side by side (tops aligned) and show one image */
+#define MAX_DISPLAYS	8
+
+struct display {
+	char    *device;		/* /dev/fbN or mem:WxHxBPP */
+	int      fd;			/* -1 for memory-backed display */
+	uint8_t *screen;		/* framebuffer memory */
+	int      screen_size;	/* in bytes */
+	int      scr_width;		/* visible area (in pixels) */
+	int      scr_height;
+	int      scr_blocks;	/* scr_width/8 */
+	int      line_length;	/* framebuffer line (in bytes) */
+	int      wall_x;		/* position on wall (in blocks) */
+
+	bool     packed;		/* packed pixels framebuffer (efifb, simplefb, ...) */
+	int      bytespp;		/* bytes per pixel (packed mode) */
+	uint32_t fg_pixel;		/* white & black pixel values (packed mode) */
+	uint32_t bg_pixel;
+
+	/* vertical retrace */
+	int    vsync_method;
+	double vsync_time;		/* when the last retrace started (ms) */
+	double frame_ms;		/* refresh period */
+	int    total_lines;		/* scanlines per frame (with blanking) */
+	int    first_line;		/* the first visible scanline after retrace */
+
+	/* double buffering -- second page below the visible one */
+	int  pages;				/* 2 if off-screen page is available */
+	int  page;				/* displayed page */
+	int  page_size;			/* in bytes */
+	bool page_dirty[2];		/* page must be cleared before drawing */
+	bool var_changed;		/* yres_virtual was changed */
+	struct fb_var_screeninfo panvar;	/* for FBIOPAN_DISPLAY */
+	struct fb_var_screeninfo oldvar;	/* settings restored on exit */
+
+	uint8_t  *shadow;		/* copy of screen while VT is released */
+	pthread_t thread;		/* render thread (if more displays) */
+};
+
+struct display displays[MAX_DISPLAYS];
+int ndisplays;
+int wall_blocks;			/* width of all displays (in blocks) */
+int wall_height;			/* height of the highest display */
+
+/* render threads -- main thread posts a job and waits until all
+   displays are done, so images are shared read-only */
+enum {
+	JOB_SHOW,				/* draw current image */
+	JOB_PRERENDER			/* draw render_pic on hidden page */
+};
+
+pthread_mutex_t render_lock  = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  render_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t  render_done  = PTHREAD_COND_INITIALIZER;
+int render_job;
+int render_serial;			/* incremented for each job */
+int render_pending;			/* displays still working on job */
+struct picture *render_pic;
+
+/* graphics session -- KD_GRAPHICS is set once, not on every redraw */
+bool session;
+volatile sig_atomic_t vt_active = 1;
+volatile sig_atomic_t drawing;			/* show_image/prerender is writing to screen */
+volatile sig_atomic_t release_pending;	/* VT release waits for drawing */
+volatile sig_atomic_t stale;			/* screen must be redrawn by main loop */
 
 uint8_t *image;			/* b/w image */
 int width;				/* image width */
@@ -64,25 +176,208 @@ int height;				/* image height */
 int dx, dy;				/* coordinates of left upper corner of displayed
                            image's portion */
 int sdx, sdy;
+bool refresh;			/* image must be redrawn */
+
+/* decoded image */
+struct picture {
+	char    *name;			/* file name */
+	uint8_t *image;			/* b/w image */
+	int      width;
+	int      blocks;
+	int      height;
+	bool     inverted;
+
+	/* option -k: source scaled to 0..255 and threshold level; rows are
+	   binarized again when they are shown (row_level -- level used) */
+	uint8_t *gray;
+	uint8_t *row_level;
+	int      level;
+
+	struct picture *next;	/* cache list, most recently used first */
+};
+
+struct picture *current;	/* displayed picture */
+struct picture *prerendered;	/* picture drawn on hidden page */
+struct picture *cache;		/* decoded images */
+int  cache_entries;
+int  cache_limit = 64;		/* in megabytes (arena budget) */
+
+/* rotations & mirrors applied (in order) to loaded images -- option -r */
+int  transforms[MAX_TRANSFORMS];
+int  ntransforms;
+
+/* files given in command line & loaded by daemon */
+char **playlist;
+int    playlist_len;
+int    playlist_pos;
+bool   want_prerender;		/* playlist position has changed */
+
+/* statistics reported by daemon */
+struct {
+	int    loads;			/* images decoded */
+	int    hits;			/* images taken from cache */
+	double load_ms;			/* last decode/cache lookup time */
+	double show_ms;			/* last show_image time */
+} stats;
+
+/* daemon socket */
+int   listen_fd = -1;
+char *listen_path;
+
+/* key trace: recorded (option -T) or replayed (option -R) */
+struct key_event {
+	double time;			/* ms since start */
+	int    key;
+	double latency;			/* replay: key to frame completion,
+					   < 0 -- key drew no frame */
+};
+
+char   *replay_path;
+struct key_event *trace;
+int     trace_len;
+FILE   *record_file;
+double  trace_start;
+double  trace_ms;			/* replay: duration */
+
+/* binarization method (option -t) */
+enum {
+	THRESHOLD_FIXED,
+	THRESHOLD_OTSU,
+	THRESHOLD_SAUVOLA,
+	THRESHOLD_BRADLEY
+};
+
+int    threshold_mode   = THRESHOLD_FIXED;
+double threshold_param  = -1;	/* fixed: level (0..255, default maxval/2),
+                                   Sauvola: k, Bradley: t */
+int    threshold_window = 0;	/* local methods: window size (option -w),
+                                   0 -- width/8 */
+bool   keep_gray;				/* keep source for threshold adjustment (-k) */
+
+#define THRESHOLD_STEP	4		/* keys + and - */
 
 /* initialzes program: opens files, registers signal handlers, etc. */
 void init();
 
+/* opens framebuffer device (or allocates memory-backed one) */
+void init_display(struct display *d);
+
 /* function that restore setting after our changes */
 void clean();
 
-/* show shifed image */
-void show_image(int dx, int dy);
+/* show image shifted by global dx, dy (on all displays) */
+void show_image();
+
+/* runs job on all displays, in parallel if there are more of them */
+void render(int job, struct picture *pic);
+void render_display(struct display *d, int job, struct picture *pic);
+void *render_thread(void *arg);
+
+/* draws current image on display */
+void show_display(struct display *d, int dx, int dy);
+
+/* reads PGM file and binarizes it, or reads PBM file */
+void read_pgm(FILE *f, struct picture *pic);
+
+/* reads pixels of PBM (P4) file, header is already read */
+void read_pbm(FILE *f, struct picture *pic, int width, int height);
 
-/* reads PGM file and binarizes it */
-void read_pgm(FILE *f);
+/* writes picture as PBM (P4) file; on error returns false (message is
+   in error_msg) */
+bool write_pbm(struct picture *pic, FILE *f);
+
+/* returns picture from cache or loads it; on error returns NULL
+   (message is in error_msg) */
+struct picture *get_picture(char *filename);
+
+/* absolute path without symlinks (or copy of path if it can't be
+   resolved) -- one cache entry per file, however it is named */
+char *canonical_path(char *path);
+
+/* makes picture current, i.e. displayed one */
+void select_picture(struct picture *pic);
+
+/* draws image if needed, returns true if it did */
+bool redraw();
+
+/* handles keyboard, returns true on quit */
+bool process_key(int key);
 
 /* as name states */
 void invert_image();
 
+/* rotates or mirrors current image (TRANSFORM_*); false if out of memory */
+bool transform_image(int op);
+
+/* transform_image for key handler: refused key rings the bell */
+void transform_key(int op);
+bool transform_picture(struct picture *pic, int op);
+
+/* sets threshold level (0..255) of current image; false if source
+   wasn't kept */
+bool set_threshold(int level);
+
+/* binarizes again rows y0..y1-1 if threshold has changed */
+void update_rows(struct picture *pic, int y0, int y1);
+
+/* the same as transform_bitmap, for 8-bit source (option -k) */
+void transform_gray(uint8_t *dst, uint8_t *src, int width, int height, int op);
+
+/* allocates arena of picture: image and (option -k) source & row levels */
+bool picture_alloc(struct picture *pic, int width, int height, bool gray);
+
+/* evicts cached images (least recently used first, never displayed one)
+   until size more bytes fit into budget */
+void cache_reclaim(size_t size);
+
+/* expands n blocks of 1-bit pixels into packed pixels (fg/bg_pixel) */
+void expand_row(struct display *d, uint8_t *dst, uint8_t *src, int n);
+
+/* detects retrace method and measures refresh rate */
+void vsync_init(struct display *d, struct fb_var_screeninfo *v);
+
+/* waits for the start of vertical retrace */
+void wait_vsync(struct display *d);
+
+/* estimated screen row being displayed (negative in blanking) */
+int beam_line(struct display *d);
+
+/* frame scheduling: frame_begin is called before update, frame_row
+   before each updated screen row */
+void frame_begin(struct display *d);
+void frame_row(struct display *d, int row);
+
+/* enables double buffering if framebuffer has memory for two pages */
+void setup_pages(struct display *d, struct fb_var_screeninfo *v,
+                 struct fb_fix_screeninfo *f);
+
+/* draws picture on hidden pages, so show_image has just to flip pages */
+void prerender(struct picture *pic);
+void prerender_display(struct display *d, struct picture *pic);
+
+/* draws image fragment on page starting at base; x, y -- position of
+   image on wall (sync -- chase the beam) */
+void draw_image(struct display *d, uint8_t *base,
+                uint8_t *img, int img_blocks, int img_height,
+                int x, int y, int dx, int dy, bool sync);
+
+/* fills page with background color */
+void clear_page(struct display *d, uint8_t *base);
+
+/* makes hidden page visible */
+void flip_page(struct display *d);
+
+/* computes position of centered picture (on wall) */
+void center_picture(struct picture *pic, int *x, int *y);
+
+/* switches console to graphics mode for the whole run */
+void session_begin();
+
+/* saves screens into shadow buffers (session) and allows VT switch */
+void release_vt();
 
-void halt_on_error(char*);
-#define ordie halt_on_error
+/* writes displayed page as PGM (daemon command "dump") */
+bool dump_display(struct display *d, char *filename);
 
 /* handlers called on activate & release virtual terminal */
 void vt_release(int dummy);
@@ -91,138 +386,384 @@ void vt_activate (int dummy);
 /* common handler for several signals (SIGTERM, SIGABRT, etc.) */
 void sig_break(int _);
 
-int main(int argc, char* argv[]) {
-	bool quit		= false;
-	bool refresh	= true;
-	FILE *f;
-	char *filename;
-	int  pdx, pdy;
+/* daemon: opens socket and processes commands & keys until quit */
+void daemon_init(char *path);
+void daemon_loop();
+
+/* client: sends command to daemon and prints reply */
+int client(char *path, int argc, char *argv[]);
+
+/* batch: loads image and writes it as PBM (option -b) */
+bool batch_picture(struct job *job, FILE *f);
+
+/* reads key trace (lines "ms key"); returns false if invalid */
+bool load_trace(char *path);
+
+/* appends key to trace file (option -T); latency < 0 -- not known */
+void record_key(double time, int key, double latency);
+
+/* feeds trace to the interactive loop, measures latencies of keys
+   which draw a frame */
+void replay();
+
+/* prints latency distribution (all keys and each key) */
+void replay_report();
+
+void usage() {
+	puts("Usage: fbi16 [options] file\n"
+	     "       fbi16 -d socket [options] [file ...]\n"
+	     "       fbi16 -c socket command\n"
+	     "       fbi16 -b dir [options] file|dir ...\n"
+	     "options:\n"
+	     "  -b dir         convert files to PBM files in dir (batch)\n"
+	     "  -f dev[,dev]   framebuffers placed side by side (default\n"
+	     "                 /dev/fb0), mem:WxHxBPP is memory-backed one\n"
+	     "  -g             stay in graphics mode (faster redraw)\n"
+	     "  -k             keep source, threshold can be changed (keys\n"
+	     "                 + and -, fixed & otsu methods)\n"
+	     "  -m megabytes   memory for images (cache size, batch limit)\n"
+	     "  -r list        rotate and/or mirror images, list of 90, 180,\n"
+	     "                 270 (clockwise), h (left-right), v (top-bottom)\n"
+	     "  -R trace       replay keys from file and report latency\n"
+	     "  -T trace       record keys to file\n"
+	     "  -t method      binarization: level (0..255), otsu,\n"
+	     "                 sauvola[:k] or bradley[:t]\n"
+	     "  -w size        window of local methods");
+	exit(0);
+}
 
-	if (argc < 2) {
-		puts("Usage: fbi16 [file]");
-		exit(0);
-	}
-	else
-		filename = argv[1];
-	
-	init();
+/* parses -t argument, returns false if invalid */
+bool parse_threshold(char *arg) {
+	char *e, *param;
 
-	image = NULL;
-	f = fopen(filename, "rb"); halt_on_error(filename);
-	read_pgm(f);
-	fclose(f);
+	param = strchr(arg, ':');
+	if (param)
+		*param++ = 0;
 
+	if (strcmp(arg, "otsu") == 0 && param == NULL) {
+		threshold_mode = THRESHOLD_OTSU;
+		return true;
+	}
+	else if (strcmp(arg, "sauvola") == 0) {
+		threshold_mode  = THRESHOLD_SAUVOLA;
+		threshold_param = 0.34;
+	}
+	else if (strcmp(arg, "bradley") == 0) {
+		threshold_mode  = THRESHOLD_BRADLEY;
+		threshold_param = 0.15;
+	}
+	else {
+		threshold_mode  = THRESHOLD_FIXED;
+		threshold_param = strtol(arg, &e, 10);
+		return *e == 0 && param == NULL &&
+		       threshold_param >= 0 && threshold_param <= 255;
+	}
 
-	/* center horizontal */
-	if (blocks < 640/8)
-		sdx = (640/8 - blocks)/2;
-	else
-		sdx = 0;
-	
-	/* center verical */
-	if (height < 480)
-		sdy = (480 - height)/2;
-	else
-		sdy = 0;
+	if (param) {
+		threshold_param = strtod(param, &e);
+		if (*e != 0 || threshold_param < 0.0 || threshold_param > 1.0)
+			return false;
+	}
+	return true;
+}
 
-	pdx = pdy = dx = dy = 0;
-	while (!quit) {
-		if (refresh || pdx != dx || pdy != dy) {
-			show_image(dx, dy);
-			pdx = dx;
-			pdy = dy;
-			refresh = false;
-		}
-		switch (getchar()) {
-			case 'q':
-			case 'Q':
-				quit = true;
+int main(int argc, char* argv[]) {
+	bool quit  = false;
+	bool limit = false;
+	char *socket_path = NULL;
+	char *client_path = NULL;
+	char *e, *dev;
+	int  opt, key, i;
+
+	while ((opt = getopt(argc, argv, "b:d:c:f:gkm:r:R:t:T:w:")) != -1)
+		switch (opt) {
+			case 'b':
+				batch_dir = optarg;
 				break;
-
-			/* scroll left */
-			case 's':
-				if (blocks > 640/8) {
-					dx += 1;
-					if (dx > (blocks - 640/8))
-						dx = blocks - 640/8;
-				}
+			case 'd':
+				socket_path = optarg;
 				break;
-			case 'S':
-				if (blocks > 640/8) {
-					dx += 2;
-					if (dx > (blocks - 640/8))
-						dx = blocks - 640/8;
-				}
+			case 'c':
+				client_path = optarg;
 				break;
-
-			/* scroll right */
-			case 'a':
-				if (blocks > 640/8) {
-					dx -= 1;
-					if (dx < 0) dx = 0;
+			case 'f':
+				for (dev = strtok(optarg, ","); dev; dev = strtok(NULL, ",")) {
+					if (ndisplays == MAX_DISPLAYS) {
+						puts("Too many displays");
+						return 1;
+					}
+					displays[ndisplays++].device = dev;
 				}
 				break;
-			case 'A':
-				if (blocks > 640/8) {
-					dx -= 2;
-					if (dx < 0) dx = 0;
+			case 'g':
+				session = true;
+				break;
+			case 'k':
+				keep_gray = true;
+				break;
+			case 'm':
+				cache_limit = strtol(optarg, &e, 10);
+				if (*e != 0 || cache_limit <= 0) {
+					puts("Invalid cache size");
+					return 1;
 				}
+				limit = true;
 				break;
-
-			/* scroll down */
-			case 'w':
-				if (height > 480) {
-					dy += 10;
-					if (dy > (height - 480))
-						dy = height - 480;
+			case 'r':
+				ntransforms = parse_transforms(optarg, transforms);
+				if (ntransforms < 0) {
+					puts("Invalid rotation");
+					return 1;
 				}
 				break;
-			case 'W':
-				if (height > 480) {
-					dy += 20;
-					if (dy > (height - 480))
-						dy = height - 480;
+			case 'R':
+				replay_path = optarg;
+				break;
+			case 't':
+				if (!parse_threshold(optarg)) {
+					puts("Invalid binarization method");
+					return 1;
 				}
 				break;
-			
-			/* scroll up */
-			case 'z':
-				if (height > 480) {
-					dy -= 10;
-					if (dy < 0) dy = 0;
+			case 'T':
+				record_file = fopen(optarg, "w");
+				if (record_file == NULL) {
+					printf("%s: %s\n", optarg, strerror(errno));
+					return 1;
 				}
 				break;
-			case 'Z':
-				if (height > 480) {
-					dy -= 20;
-					if (dy < 0) dy = 0;
+			case 'w':
+				threshold_window = strtol(optarg, &e, 10);
+				if (*e != 0 || threshold_window <= 0) {
+					puts("Invalid window size");
+					return 1;
 				}
 				break;
+			default:
+				usage();
+		}
 
-			/* refresh image */
-			case '\n':
-			case 'r':
-			case 'R':
-				refresh = true;
-				break;
+	if (client_path)
+		return client(client_path, argc - optind, &argv[optind]);
 
-			/* invert image */ 
-			case 'i':
-			case 'I':
-				invert_image();
-				refresh = true;
-				break;
+	if (keep_gray && threshold_mode != THRESHOLD_FIXED && threshold_mode != THRESHOLD_OTSU) {
+		puts("Option -k works with fixed and otsu methods only");
+		return 1;
+	}
+
+	if (batch_dir) {
+		if (keep_gray) {
+			puts("Option -k can't be used with -b");
+			return 1;
+		}
+		if (optind >= argc)
+			usage();
+
+		/* no cache to evict: workers wait for each other's memory
+		   (arena_wait); without -m images aren't limited */
+		if (limit) {
+			arena_budget  = (size_t)cache_limit * 1024 * 1024;
+			arena_reclaim = NULL;
+		}
+		return batch(batch_dir, &argv[optind], argc - optind, ".pbm", batch_picture);
+	}
+
+	if (optind >= argc && socket_path == NULL)
+		usage();
+
+	if (replay_path) {
+		if (socket_path) {
+			puts("Option -R can't be used with -d");
+			return 1;
+		}
+		if (!load_trace(replay_path))
+			return 1;
+	}
+
+	playlist_len = argc - optind;
+	playlist_pos = 0;
+	playlist     = (char**)malloc((playlist_len + 1) * sizeof(char*));
+	if (playlist == NULL) {
+		puts("malloc failed (playlist)");
+		return 1;
+	}
+	for (i=0; i < playlist_len; i++) {
+		playlist[i] = canonical_path(argv[optind + i]);
+		if (playlist[i] == NULL) {
+			puts("malloc failed (playlist)");
+			return 1;
+		}
+	}
+
+	if (ndisplays == 0)
+		displays[ndisplays++].device = "/dev/fb0";
+
+	arena_budget  = (size_t)cache_limit * 1024 * 1024;
+	arena_reclaim = cache_reclaim;
+
+	init();
+	if (session)
+		session_begin();
+
+	if (socket_path) {
+		daemon_init(socket_path);
+		if (playlist_len > 0)
+			select_picture(get_picture(playlist[0]));
+		daemon_loop();
+	}
+	else {
+		if (get_picture(playlist[0]) == NULL)
+			error(error_msg);
+		select_picture(cache);
+		if (replay_path)
+			replay();
+		else {
+			trace_start = now_ms();
+			while (!quit) {
+				redraw();
+				key = getchar();
+				if (key == EOF && errno == EINTR) { /* VT switch */
+					errno = 0;
+					clearerr(stdin);
+					continue;
+				}
+				if (record_file)
+					record_key(now_ms() - trace_start, key, -1.0);
+				quit = process_key(key);
+			}
 		}
 	}
 
 	clean();
+	if (record_file)
+		fclose(record_file);
+	if (replay_path)
+		replay_report();
 	return EXIT_SUCCESS;
 }
 
+bool process_key(int key) {
+	switch (key) {
+		case 'q':
+		case 'Q':
+			return true;
+
+		/* scroll left */
+		case 's':
+			if (blocks > wall_blocks) {
+				dx += 1;
+				if (dx > (blocks - wall_blocks))
+					dx = blocks - wall_blocks;
+			}
+			break;
+		case 'S':
+			if (blocks > wall_blocks) {
+				dx += 2;
+				if (dx > (blocks - wall_blocks))
+					dx = blocks - wall_blocks;
+			}
+			break;
+
+		/* scroll right */
+		case 'a':
+			if (blocks > wall_blocks) {
+				dx -= 1;
+				if (dx < 0) dx = 0;
+			}
+			break;
+		case 'A':
+			if (blocks > wall_blocks) {
+				dx -= 2;
+				if (dx < 0) dx = 0;
+			}
+			break;
+
+		/* scroll down */
+		case 'w':
+			if (height > wall_height) {
+				dy += 10;
+				if (dy > (height - wall_height))
+					dy = height - wall_height;
+			}
+			break;
+		case 'W':
+			if (height > wall_height) {
+				dy += 20;
+				if (dy > (height - wall_height))
+					dy = height - wall_height;
+			}
+			break;
+		
+		/* scroll up */
+		case 'z':
+			if (height > wall_height) {
+				dy -= 10;
+				if (dy < 0) dy = 0;
+			}
+			break;
+		case 'Z':
+			if (height > wall_height) {
+				dy -= 20;
+				if (dy < 0) dy = 0;
+			}
+			break;
+
+		/* refresh image */
+		case '\n':
+		case 'r':
+		case 'R':
+			refresh = true;
+			break;
+
+		/* invert image */ 
+		case 'i':
+		case 'I':
+			invert_image();
+			refresh = true;
+			break;
+
+		/* change threshold */
+		case '+':
+		case '=':
+			if (current)
+				set_threshold(current->level + THRESHOLD_STEP);
+			break;
+		case '-':
+			if (current)
+				set_threshold(current->level - THRESHOLD_STEP);
+			break;
+
+		/* rotate & mirror image */
+		case '.':
+		case '>':
+			transform_key(TRANSFORM_ROTATE_90);
+			break;
+		case ',':
+		case '<':
+			transform_key(TRANSFORM_ROTATE_270);
+			break;
+		case 'h':
+		case 'H':
+			transform_key(TRANSFORM_MIRROR);
+			break;
+		case 'v':
+		case 'V':
+			transform_key(TRANSFORM_FLIP);
+			break;
+	}
+
+	return false;
+}
+
 /* implemetation ****************************************************/
 
 void halt_on_error(char* info) {
 	if (errno != 0) {
+		if (recover) {
+			snprintf(error_msg, sizeof(error_msg), "%s: %s", info, strerror(errno));
+			errno = 0;
+			longjmp(*recover, 1);
+		}
 		clean();
 		fprintf(stdout, "%s: %s\n", info, strerror(errno));
 		exit(EXIT_FAILURE);
@@ -230,93 +771,609 @@ void halt_on_error(char* info) {
 }
 
 void error(char* info) {
+	if (recover) {
+		snprintf(error_msg, sizeof(error_msg), "%s", info);
+		longjmp(*recover, 1);
+	}
 	clean();
 	fprintf(stdout, "%s\n", info);
 	exit(EXIT_FAILURE);
 }
 
-void read_pgm(FILE *f) {
-	int maxval;
+/* Binarization.  Image is split into bands of rows, which are processed
+   by separate threads (if file is seekable, rows are read with pread).
+   Local methods keep just a window of rows: column sums of the window are
+   updated when the window slides down, and prefix sums of them form an
+   integral image of the band, so mean & variance of any window cost O(1). */
+
+struct band {
+	struct picture *pic;
+	int      y0, y1;		/* rows to binarize */
+
+	/* source: pread from fd, memory or sequential fread from f;
+	   file is read through reader */
+	FILE    *f;
+	int      fd;
+	off_t    offset;		/* of first row */
+	uint8_t *data;
+	struct reader *reader;
+
+	int      maxval;
+	int      rowbytes;		/* bytes per row in file */
+	int      threshold;		/* global threshold (fixed & Otsu) */
+	uint32_t *histogram;	/* Otsu: histogram pass */
+
+	int      window;		/* local methods: window size */
+
+	char    *error;			/* NULL if succeed */
+};
+
+/* reads row y (raw file data); rows are read in order */
+uint8_t *band_raw_row(struct band *b, int y, uint8_t *buf) {
+	if (b->data)
+		return b->data + (size_t)y * b->rowbytes;
+	else
+		return reader_next(b->reader, b->rowbytes, buf);
+}
+
+/* converts raw row to 16-bit values (PGM stores MSB first) */
+void gray_row(uint16_t *dst, uint8_t *raw, int width, int maxval) {
+	int x;
+
+	if (maxval < 256)
+		for (x=0; x < width; x++)
+			dst[x] = raw[x];
+	else
+		for (x=0; x < width; x++)
+			dst[x] = (raw[2*x] << 8) | raw[2*x + 1];
+}
+
+/* converts raw row to 8-bit values 0..255 (kept source, option -k) */
+void scale_row(uint8_t *dst, uint8_t *raw, int width, int maxval) {
+	int x;
+
+	if (maxval == 255)
+		memcpy(dst, raw, width);
+	else if (maxval < 256)
+		for (x=0; x < width; x++)
+			dst[x] = raw[x] * 255 / maxval;
+	else
+		for (x=0; x < width; x++)
+			dst[x] = ((raw[2*x] << 8) | raw[2*x + 1]) * 255 / maxval;
+}
+
+/* packs row: bit is set if pixel > threshold; n -- number of pixels */
+void pack_row8(uint8_t *dst, uint8_t *src, int n, int threshold) {
+	unsigned bits;
+	int x;
+#ifdef __SSE2__
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+	const __m128i t    = _mm_set1_epi8((char)(threshold ^ 0x80));
+	__m128i v;
+	int m;
+
+	for (x=0; x + 16 <= n; x += 16) {
+		/* unsigned compare */
+		v = _mm_cmpgt_epi8(_mm_xor_si128(_mm_loadu_si128((__m128i*)&src[x]), bias), t);
+		/* reverse bytes in both halves, so the first pixel becomes MSB */
+		v = _mm_shufflelo_epi16(_mm_shufflehi_epi16(v, 0x1b), 0x1b);
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		m = _mm_movemask_epi8(v);
+		dst[x/8 + 0] = m;
+		dst[x/8 + 1] = m >> 8;
+	}
+#else
+	x = 0;
+#endif
+	for (bits = 0; x < n; x++) {
+		bits = (bits << 1) | (src[x] > threshold);
+		if ((x & 7) == 7) {
+			dst[x/8] = bits;
+			bits = 0;
+		}
+	}
+	if (n & 7)
+		dst[n/8] = bits << (8 - (n & 7));
+}
+
+void pack_row16(uint8_t *dst, uint16_t *src, int n, int threshold) {
+	unsigned bits;
+	int x;
+#ifdef __SSE2__
+	const __m128i bias = _mm_set1_epi16((short)0x8000);
+	const __m128i t    = _mm_set1_epi16((short)(threshold ^ 0x8000));
+	__m128i lo, hi, v;
+	int m;
+
+	for (x=0; x + 16 <= n; x += 16) {
+		lo = _mm_cmpgt_epi16(_mm_xor_si128(_mm_loadu_si128((__m128i*)&src[x + 0]), bias), t);
+		hi = _mm_cmpgt_epi16(_mm_xor_si128(_mm_loadu_si128((__m128i*)&src[x + 8]), bias), t);
+		v  = _mm_packs_epi16(lo, hi);
+		v  = _mm_shufflelo_epi16(_mm_shufflehi_epi16(v, 0x1b), 0x1b);
+		v  = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		m  = _mm_movemask_epi8(v);
+		dst[x/8 + 0] = m;
+		dst[x/8 + 1] = m >> 8;
+	}
+#else
+	x = 0;
+#endif
+	for (bits = 0; x < n; x++) {
+		bits = (bits << 1) | (src[x] > threshold);
+		if ((x & 7) == 7) {
+			dst[x/8] = bits;
+			bits = 0;
+		}
+	}
+	if (n & 7)
+		dst[n/8] = bits << (8 - (n & 7));
+}
 
-	uint8_t* line;
-	uint8_t* imgpix;
+/* global threshold (or histogram for Otsu) */
+void binarize_global(struct band *b) {
+	struct picture *pic = b->pic;
+	int      n = pic->width;
+	uint8_t  *raw, *buf;
+	uint16_t *gray;
 	int y, x;
-	int c;
 
-	c       = fscanf(f, "P5\n%d %d\n%d", &width, &height, &maxval);
-	if (c < 3)
-		error("Not a PGM file");
-	/*if (maxval > 255)
-		error("16-bit PGM not supported");*/
-	
-	blocks	= (width+7)/8;
-	if (maxval > 255) {
-		line = (uint8_t*)malloc(8*blocks*2);
-		if (line == NULL)
-			error("malloc failed (1)");
-		else
-			memset(line, 0, 8*blocks*2);
+	buf  = (uint8_t*)malloc(b->rowbytes);
+	gray = (uint16_t*)malloc(n * sizeof(uint16_t));
+	if (buf == NULL || gray == NULL) {
+		b->error = "malloc failed (band)";
+		goto end;
+	}
+
+	for (y = b->y0; y < b->y1; y++) {
+		raw = band_raw_row(b, y, buf);
+		if (raw == NULL) {
+			b->error = "Truncated PGM file";
+			break;
+		}
+
+		if (b->histogram) {
+			gray_row(gray, raw, pic->width, b->maxval);
+			for (x=0; x < pic->width; x++)
+				b->histogram[gray[x]]++;
+		}
+		else if (pic->gray) {
+			/* source is kept and binarized as 8-bit */
+			scale_row(&pic->gray[(size_t)y * n], raw, n, b->maxval);
+			pack_row8(&pic->image[y * pic->blocks], &pic->gray[(size_t)y * n], n, pic->level);
+		}
+		else if (b->maxval < 256)
+			pack_row8(&pic->image[y * pic->blocks], raw, n, b->threshold);
+		else {
+			gray_row(gray, raw, pic->width, b->maxval);
+			pack_row16(&pic->image[y * pic->blocks], gray, n, b->threshold);
+		}
+	}
+
+end:
+	free(buf);
+	free(gray);
+}
+
+/* Sauvola & Bradley local thresholds */
+void binarize_local(struct band *b) {
+	struct picture *pic = b->pic;
+	int      width = pic->width;
+	int      r     = b->window/2;
+	int      rows  = 2*r + 1;
+	uint8_t  *buf, *raw, *out;
+	uint16_t *ring, *g, *gin, *gout, *tmp, *zero;
+	uint32_t *colsum;
+	uint64_t *colsq, *sum, *sq;
+	double   *inv_cols;
+	int      y, x, x0, x1, ya, yb, next, first;
+	double   inv, m, var, a, t, kr2;
+	uint64_t acc, acc2;
+	unsigned bits;
+	bool     sauvola = (threshold_mode == THRESHOLD_SAUVOLA);
+
+	buf    = (uint8_t*)malloc(b->rowbytes);
+	ring   = (uint16_t*)malloc((size_t)rows * width * sizeof(uint16_t));
+	tmp    = (uint16_t*)malloc(width * sizeof(uint16_t));
+	zero   = (uint16_t*)calloc(width, sizeof(uint16_t));
+	colsum = (uint32_t*)calloc(width, sizeof(uint32_t));
+	colsq  = (uint64_t*)calloc(width, sizeof(uint64_t));
+	sum    = (uint64_t*)malloc((width + 1) * sizeof(uint64_t));
+	sq     = (uint64_t*)malloc((width + 1) * sizeof(uint64_t));
+	inv_cols = (double*)malloc(width * sizeof(double));
+	if (!buf || !ring || !tmp || !zero || !colsum || !colsq || !sum || !sq || !inv_cols) {
+		b->error = "malloc failed (band)";
+		goto end;
+	}
+
+	/* 1/(number of columns in window of x) -- no division in inner loop */
+	for (x=0; x < width; x++) {
+		x0 = x - r < 0 ? 0 : x - r;
+		x1 = x + r >= width ? width - 1 : x + r;
+		inv_cols[x] = 1.0 / (x1 - x0 + 1);
+	}
+
+	/* window of row y: rows first..next-1 */
+	first = b->y0 - r < 0 ? 0 : b->y0 - r;
+	next  = first;
+	t     = threshold_param;
+	kr2   = t / ((b->maxval + 1) / 2.0);	/* Sauvola: (k/R)^2 */
+	kr2  *= kr2;
+
+	for (y = b->y0; y < b->y1; y++) {
+		ya = y - r < 0 ? 0 : y - r;
+		yb = y + r >= pic->height ? pic->height - 1 : y + r;
+
+		/* slide window down: usually one row leaves and one enters,
+		   column sums are updated in single pass */
+		while (first < ya || next <= yb) {
+			gout = first < ya ? &ring[(first % rows) * width] : zero;
+			gin  = zero;
+			if (next <= yb) {
+				raw = band_raw_row(b, next, buf);
+				if (raw == NULL) {
+					b->error = "Truncated PGM file";
+					goto end;
+				}
+				gray_row(tmp, raw, width, b->maxval);
+				gin = tmp;
+			}
+
+			for (x=0; x < width; x++)
+				colsum[x] += gin[x] - gout[x];
+			if (sauvola)
+				for (x=0; x < width; x++)
+					colsq[x] += (int64_t)gin[x] * gin[x] - (int64_t)gout[x] * gout[x];
+
+			if (first < ya)
+				first++;
+			if (gin == tmp) {
+				memcpy(&ring[(next % rows) * width], tmp, width * sizeof(uint16_t));
+				next++;
+			}
+		}
+
+		/* integral of the band */
+		acc = acc2 = 0;
+		sum[0] = sq[0] = 0;
+		for (x=0; x < width; x++) {
+			acc += colsum[x];
+			sum[x + 1] = acc;
+		}
+		if (sauvola)
+			for (x=0; x < width; x++) {
+				acc2 += colsq[x];
+				sq[x + 1] = acc2;
+			}
+
+		g    = &ring[(y % rows) * width];
+		out  = &pic->image[y * pic->blocks];
+		inv  = 1.0 / (yb - ya + 1);
+		bits = 0;
+		for (x=0; x < width; x++) {
+			x0 = x - r < 0 ? 0 : x - r;
+			x1 = x + r >= width ? width - 1 : x + r;
+			m  = (int64_t)(sum[x1 + 1] - sum[x0]) * inv * inv_cols[x];
+
+			if (!sauvola)
+				/* Bradley: pixel > (1 - t) * mean */
+				bits = (bits << 1) | (g[x] > (1.0 - t) * m);
+			else {
+				/* pixel > m * (1 + k*(stddev/R - 1)), i.e.
+				   pixel - m*(1 - k) > m*k*stddev/R */
+				var  = (int64_t)(sq[x1 + 1] - sq[x0]) * inv * inv_cols[x] - m*m;
+				a    = g[x] - m * (1.0 - t);
+				bits = (bits << 1) | ((a > 0) & (a*a > m*m * kr2 * var));
+			}
+
+			if ((x & 7) == 7) {
+				out[x/8] = bits;
+				bits = 0;
+			}
+		}
+		if (width & 7)
+			out[width/8] = bits << (8 - (width & 7));
+	}
+
+end:
+	free(buf);
+	free(ring);
+	free(colsum);
+	free(colsq);
+	free(sum);
+	free(sq);
+	free(inv_cols);
+	free(tmp);
+	free(zero);
+}
+
+void *band_thread(void *arg) {
+	struct band   *b = (struct band*)arg;
+	struct reader reader;
+	bool   local;
+	int    ya, yb, r;
+
+	local = (threshold_mode == THRESHOLD_SAUVOLA || threshold_mode == THRESHOLD_BRADLEY);
+
+	/* rows needed by band */
+	r  = local ? b->window/2 : 0;
+	ya = b->y0 - r < 0 ? 0 : b->y0 - r;
+	yb = b->y1 + r > b->pic->height ? b->pic->height : b->y1 + r;
+
+	if (b->data == NULL) {
+		if (!reader_open(&reader, b->f, b->fd,
+		                 b->offset + (off_t)ya * b->rowbytes,
+		                 (off_t)(yb - ya) * b->rowbytes)) {
+			b->error = "reader failed";
+			return NULL;
+		}
+		b->reader = &reader;
 	}
+
+	if (local)
+		binarize_local(b);
+	else
+		binarize_global(b);
+
+	if (b->data == NULL)
+		reader_close(&reader);
+
+	return NULL;
+}
+
+/* splits rows into bands and processes them; returns error message */
+char *run_bands(struct band *proto) {
+	struct band *bands;
+	pthread_t   *threads;
+	char *err = NULL;
+	int  n, i, k;
+
+	/* sequential source can't be shared */
+	if (proto->fd < 0 && proto->data == NULL)
+		n = 1;
 	else {
-		line = (uint8_t*)malloc(8*blocks);
-		if (line == NULL)
-			error("malloc failed (2)");
-		else
-			memset(line, 0, 8*blocks);
+		n = processors();
+		if (n > proto->pic->height / 64)
+			n = proto->pic->height / 64;
+		if (n < 1)
+			n = 1;
 	}
 
-	image	= (uint8_t*)malloc(blocks * height);
-	if (image == NULL) error("malloc failed");
-	
-	imgpix	= &image[0];
+	bands   = (struct band*)calloc(n, sizeof(struct band));
+	threads = (pthread_t*)calloc(n, sizeof(pthread_t));
+	if (bands == NULL || threads == NULL) {
+		err = "malloc failed (bands)";
+		goto end;
+	}
 
-	/* read file line by line */
+	for (i=0; i < n; i++) {
+		bands[i]    = *proto;
+		bands[i].y0 = (int)((int64_t)proto->pic->height * i / n);
+		bands[i].y1 = (int)((int64_t)proto->pic->height * (i + 1) / n);
+		if (proto->histogram) {
+			bands[i].histogram = (uint32_t*)calloc(proto->maxval + 1, sizeof(uint32_t));
+			if (bands[i].histogram == NULL)
+				bands[i].error = "malloc failed (histogram)";
+		}
+	}
 
-	if (maxval < 256) {
-		for (y=0; y < height; y++) {
-			if (fread((void*)line, width, 1, f) < 1) 
-				error("Truncated PGM file");
-			halt_on_error("fread");
-			
-			for (x=0; x < blocks; x++)
-				*imgpix++ = (
-					(line[x*8 + 0] > 127 ? 0x80 : 0x00) |
-					(line[x*8 + 1] > 127 ? 0x40 : 0x00) |
-					(line[x*8 + 2] > 127 ? 0x20 : 0x00) |
-					(line[x*8 + 3] > 127 ? 0x10 : 0x00) |
-					(line[x*8 + 4] > 127 ? 0x08 : 0x00) |
-					(line[x*8 + 5] > 127 ? 0x04 : 0x00) |
-					(line[x*8 + 6] > 127 ? 0x02 : 0x00) |
-					(line[x*8 + 7] > 127 ? 0x01 : 0x00)
-				);
-		}
-	}
-	else { /* maxval >= 256 -> 2 bytes per pixel */
-		for (y=0; y < height; y++) {
-			if (fread((void*)line, 2*width, 1, f) < 1) 
+	if (n == 1)
+		band_thread(&bands[0]);
+	else {
+		for (i=0; i < n; i++)
+			if (pthread_create(&threads[i], NULL, band_thread, &bands[i]) != 0)
+				band_thread(&bands[i]);
+		for (i=0; i < n; i++)
+			if (threads[i])
+				pthread_join(threads[i], NULL);
+	}
+
+	for (i=0; i < n; i++) {
+		if (bands[i].error && err == NULL)
+			err = bands[i].error;
+		if (bands[i].histogram) {
+			for (k=0; k <= proto->maxval; k++)
+				proto->histogram[k] += bands[i].histogram[k];
+			free(bands[i].histogram);
+		}
+	}
+
+end:
+	free(bands);
+	free(threads);
+	return err;
+}
+
+/* Otsu method: threshold that maximizes between-class variance */
+int otsu_threshold(uint32_t *histogram, int maxval) {
+	double total = 0.0, sum = 0.0;
+	double wb = 0.0, sumb = 0.0, wf, mb, mf, between, best = -1.0;
+	int    t, threshold = maxval/2;
+
+	for (t=0; t <= maxval; t++) {
+		total += histogram[t];
+		sum   += (double)t * histogram[t];
+	}
+
+	for (t=0; t < maxval; t++) {
+		wb += histogram[t];
+		if (wb == 0.0)
+			continue;
+		wf = total - wb;
+		if (wf == 0.0)
+			break;
+
+		sumb += (double)t * histogram[t];
+		mb    = sumb / wb;
+		mf    = (sum - sumb) / wf;
+		between = wb * wf * (mb - mf) * (mb - mf);
+		if (between > best) {
+			best      = between;
+			threshold = t;
+		}
+	}
+
+	return threshold;
+}
+
+void read_pgm(FILE *f, struct picture *pic) {
+	struct band proto;
+	struct stat st;
+	int  maxval;
+	int  width, height;
+	int  format;
+	int  c;
+	char *err;
+
+	c       = fscanf(f, "P%d %d %d", &format, &width, &height);
+	if (c < 3 || (format != 4 && format != 5))
+		error("Not a PGM file");
+	if (width <= 0 || height <= 0)
+		error("Invalid PGM size");
+	if (format == 4) {
+		read_pbm(f, pic, width, height);
+		return;
+	}
+
+	c       = fscanf(f, "%d", &maxval);
+	if (c < 1 || maxval <= 0 || maxval > 65535)
+		error("Invalid PGM maxval");
+	fgetc(f);	/* single whitespace after maxval */
+	
+	if (!picture_alloc(pic, width, height, keep_gray))
+		error("not enough memory for image (see -m)");
+
+	memset(&proto, 0, sizeof(proto));
+	proto.pic		= pic;
+	proto.f			= f;
+	proto.fd		= -1;
+	proto.maxval	= maxval;
+	proto.rowbytes	= (maxval < 256 ? 1 : 2) * width;
+
+	/* local window: 1/8 of image width by default */
+	proto.window	= threshold_window;
+	if (proto.window <= 0) {
+		proto.window = width/8;
+		if (proto.window < 15)  proto.window = 15;
+		if (proto.window > 255) proto.window = 255;
+	}
+	proto.window |= 1;
+
+	/* rows of regular file can be read in parallel */
+	proto.offset = ftell(f);
+	if (proto.offset >= 0 && fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)) {
+		if (st.st_size < proto.offset + (off_t)proto.rowbytes * height)
+			error("Truncated PGM file");
+		proto.fd = fileno(f);
+	}
+	errno = 0;
+
+	if (threshold_mode == THRESHOLD_OTSU) {
+		/* data is read twice: histogram, then binarization */
+		if (proto.fd < 0) {
+			proto.data = (uint8_t*)malloc((size_t)proto.rowbytes * height);
+			if (proto.data == NULL)
+				error("malloc failed (data)");
+			if (fread(proto.data, proto.rowbytes, height, f) < (size_t)height) {
+				free(proto.data);
 				error("Truncated PGM file");
-			halt_on_error("fread");
-			
-			for (x=0; x < blocks; x++)
-				*imgpix++ = (
-					(line[x*16 +  1] > 127 ? 0x80 : 0x00) |
-					(line[x*16 +  3] > 127 ? 0x40 : 0x00) |
-					(line[x*16 +  5] > 127 ? 0x20 : 0x00) |
-					(line[x*16 +  7] > 127 ? 0x10 : 0x00) |
-					(line[x*16 +  9] > 127 ? 0x08 : 0x00) |
-					(line[x*16 + 11] > 127 ? 0x04 : 0x00) |
-					(line[x*16 + 13] > 127 ? 0x02 : 0x00) |
-					(line[x*16 + 15] > 127 ? 0x01 : 0x00)
-				);
+			}
+		}
+
+		proto.histogram = (uint32_t*)calloc(maxval + 1, sizeof(uint32_t));
+		if (proto.histogram == NULL) {
+			free(proto.data);
+			error("malloc failed (histogram)");
 		}
+		err = run_bands(&proto);
+		proto.threshold = otsu_threshold(proto.histogram, maxval);
+		free(proto.histogram);
+		proto.histogram = NULL;
+		if (err) {
+			free(proto.data);
+			error(err);
+		}
+	}
+	else if (threshold_param >= 0)
+		proto.threshold = (int)(threshold_param * maxval / 255);
+	else
+		proto.threshold = maxval/2;
+
+	if (pic->gray) {
+		/* level of 8-bit source */
+		if (threshold_mode == THRESHOLD_FIXED && threshold_param >= 0)
+			pic->level = (int)threshold_param;
+		else
+			pic->level = proto.threshold * 255 / maxval;
+		memset(pic->row_level, pic->level, height);
+	}
+
+	err = run_bands(&proto);
+	free(proto.data);
+	if (err)
+		error(err);
+}
+
+void read_pbm(FILE *f, struct picture *pic, int width, int height) {
+	uint8_t *row, mask;
+	size_t  n;
+	int     x, y;
+
+	fgetc(f);	/* single whitespace after height */
+
+	if (!picture_alloc(pic, width, height, false))
+		error("not enough memory for image (see -m)");
+
+	n = (size_t)pic->blocks * height;
+	if (fread(pic->image, 1, n, f) < n)
+		error("Truncated PBM file");
+
+	/* PBM: 1 is black; padding bits are cleared */
+	mask = (width & 7) ? 0xff << (8 - (width & 7)) : 0xff;
+	for (y=0; y < height; y++) {
+		row = &pic->image[(size_t)y * pic->blocks];
+		for (x=0; x < pic->blocks; x++)
+			row[x] = ~row[x];
+		row[pic->blocks - 1] &= mask;
+	}
+}
+
+bool write_pbm(struct picture *pic, FILE *f) {
+	uint8_t *row, *src;
+	int  x, y;
+	bool ok;
+
+	row = (uint8_t*)malloc(pic->blocks);
+	if (row == NULL) {
+		snprintf(error_msg, sizeof(error_msg), "malloc failed (PBM)");
+		return false;
+	}
+
+	fprintf(f, "P4\n%d %d\n", pic->width, pic->height);
+	for (y=0; y < pic->height; y++) {
+		src = &pic->image[(size_t)y * pic->blocks];
+		for (x=0; x < pic->blocks; x++)
+			row[x] = pic->inverted ? src[x] : ~src[x];
+		fwrite(row, 1, pic->blocks, f);
+	}
+
+	ok = !ferror(f);
+	if (!ok) {
+		snprintf(error_msg, sizeof(error_msg), "write failed: %s", strerror(errno));
+		errno = 0;
 	}
-	free(line);
+	free(row);
+	return ok;
 }
 
 void invert_image() {
 	uint8_t *pix;
 	int     i, n;
 
+	if (prerendered == current)
+		prerendered = NULL;
+	if (current)
+		current->inverted = !current->inverted;
+
 	pix = &image[0];
 	n   = blocks*height;
 	for (i=0; i<n; i++) {
@@ -325,48 +1382,248 @@ void invert_image() {
 	}
 }
 
-int fb_fd, tty_fd;
+bool transform_image(int op) {
+	if (current == NULL)
+		return true;
+
+	if (!transform_picture(current, op))
+		return false;
+
+	if (prerendered == current)
+		prerendered = NULL;
+
+	/* size has changed -- center again */
+	select_picture(current);
+	return true;
+}
+
+void transform_key(int op) {
+	/* image stays as it was (not enough memory, see -m); replay
+	   report is not mixed with the bell */
+	if (!transform_image(op) && isatty(STDOUT_FILENO)) {
+		putchar('\a');
+		fflush(stdout);
+	}
+}
+
+bool transform_picture(struct picture *pic, int op) {
+	struct picture rotated;
+
+	/* gray rows are renumbered -- bring all image rows up to date first */
+	if (pic->gray)
+		update_rows(pic, 0, pic->height);
+
+	if (op != TRANSFORM_ROTATE_90 && op != TRANSFORM_ROTATE_270) {
+		if (!transform_bitmap(NULL, pic->image, pic->width, pic->height, op))
+			return false;
+		if (pic->gray)
+			transform_gray(NULL, pic->gray, pic->width, pic->height, op);
+		return true;
+	}
+
+	/* size is swapped -- new arena */
+	if (!picture_alloc(&rotated, pic->height, pic->width, pic->gray != NULL))
+		return false;
+	if (!transform_bitmap(rotated.image, pic->image, pic->width, pic->height, op)) {
+		arena_free(rotated.image);
+		return false;
+	}
+	if (pic->gray) {
+		transform_gray(rotated.gray, pic->gray, pic->width, pic->height, op);
+		memset(rotated.row_level, pic->level, rotated.height);
+	}
+	arena_free(pic->image);
+
+	pic->image     = rotated.image;
+	pic->gray      = rotated.gray;
+	pic->row_level = rotated.row_level;
+	pic->width     = rotated.width;
+	pic->blocks    = rotated.blocks;
+	pic->height    = rotated.height;
+	return true;
+}
+
+bool picture_alloc(struct picture *pic, int width, int height, bool gray) {
+	size_t  image_size, gray_size;
+	uint8_t *p;
+
+	/* parts at aligned offsets */
+	image_size = arena_round((size_t)((width + 7)/8) * height);
+	gray_size  = gray ? arena_round((size_t)width * height) : 0;
+
+	p = (uint8_t*)arena_alloc(image_size + gray_size + (gray ? height : 0));
+	if (p == NULL)
+		return false;
+
+	pic->image     = p;
+	pic->gray      = gray ? p + image_size : NULL;
+	pic->row_level = gray ? p + image_size + gray_size : NULL;
+	pic->width     = width;
+	pic->blocks    = (width + 7)/8;
+	pic->height    = height;
+	return true;
+}
+
+void transform_gray(uint8_t *dst, uint8_t *src, int width, int height, int op) {
+	uint8_t *row, *top, *bottom, t;
+	int     tx, ty, x, y, x1, y1;
+	size_t  i, n;
+
+	n = (size_t)width * height;
+	switch (op) {
+		case TRANSFORM_ROTATE_90:
+		case TRANSFORM_ROTATE_270:
+			/* 32x32 tiles, so both images are accessed by cache lines */
+			for (ty = 0; ty < height; ty += 32)
+				for (tx = 0; tx < width; tx += 32) {
+					y1 = ty + 32 < height ? ty + 32 : height;
+					x1 = tx + 32 < width  ? tx + 32 : width;
+					for (y = ty; y < y1; y++) {
+						row = &src[(size_t)y * width];
+						if (op == TRANSFORM_ROTATE_90)
+							for (x = tx; x < x1; x++)
+								dst[(size_t)x * height + height - 1 - y] = row[x];
+						else
+							for (x = tx; x < x1; x++)
+								dst[(size_t)(width - 1 - x) * height + y] = row[x];
+					}
+				}
+			break;
+
+		case TRANSFORM_ROTATE_180:
+			for (i = 0; i < n/2; i++) {
+				t              = src[i];
+				src[i]         = src[n - 1 - i];
+				src[n - 1 - i] = t;
+			}
+			break;
+
+		case TRANSFORM_MIRROR:
+			for (y = 0; y < height; y++) {
+				row = &src[(size_t)y * width];
+				for (x = 0; x < width/2; x++) {
+					t                  = row[x];
+					row[x]             = row[width - 1 - x];
+					row[width - 1 - x] = t;
+				}
+			}
+			break;
+
+		case TRANSFORM_FLIP:
+			for (y = 0; y < height/2; y++) {
+				top    = &src[(size_t)y * width];
+				bottom = &src[(size_t)(height - 1 - y) * width];
+				for (x = 0; x < width; x++) {
+					t         = top[x];
+					top[x]    = bottom[x];
+					bottom[x] = t;
+				}
+			}
+			break;
+	}
+}
+
+bool set_threshold(int level) {
+	if (current == NULL || current->gray == NULL)
+		return false;
+
+	if (level < 0)   level = 0;
+	if (level > 255) level = 255;
+	if (level == current->level)
+		return true;
+
+	/* visible rows are binarized by show_image, the rest when shown */
+	current->level = level;
+	if (prerendered == current)
+		prerendered = NULL;
+	refresh = true;
+	return true;
+}
+
+void update_rows(struct picture *pic, int y0, int y1) {
+	uint8_t *row;
+	int     y, i;
+
+	if (pic == NULL || pic->gray == NULL)
+		return;
+
+	if (y0 < 0)           y0 = 0;
+	if (y1 > pic->height) y1 = pic->height;
+	for (y = y0; y < y1; y++) {
+		if (pic->row_level[y] == pic->level)
+			continue;
+
+		row = &pic->image[y * pic->blocks];
+		pack_row8(row, &pic->gray[(size_t)y * pic->width], pic->width, pic->level);
+		if (pic->inverted)
+			for (i=0; i < pic->blocks; i++)
+				row[i] = ~row[i];
+		pic->row_level[y] = pic->level;
+	}
+}
+
+int tty_fd;			/* -1 -- replay without terminal */
 struct termios term;
 
+/* builds pixel value from 8-bit RGB components (true/direct color modes) */
+uint32_t make_pixel(struct fb_var_screeninfo *v, uint8_t r, uint8_t g, uint8_t b) {
+	return ((uint32_t)(r >> (8 - v->red.length))   << v->red.offset)   |
+	       ((uint32_t)(g >> (8 - v->green.length)) << v->green.offset) |
+	       ((uint32_t)(b >> (8 - v->blue.length))  << v->blue.offset);
+}
+
 void init() {
 	int old_clflag;
-	struct fb_fix_screeninfo fixscreeninfo;
-	struct fb_fix_screeninfo varscreeninfo;
+	struct display *d;
+	int i;
 	
 	struct sigaction sa;
 	struct vt_mode s;
 
+	memset(&sa, 0, sizeof(sa));
 	
-	/* open terminal */
-	tty_fd	= open("/dev/tty", O_RDWR); halt_on_error("/dev/tty");
-	
-	/* set raw mode (and save terminal settings) */
-	tcgetattr(tty_fd, &term); halt_on_error("tcgetattr");
-	old_clflag		 = term.c_lflag;
-	term.c_lflag	&= ~(ICANON | ECHO);
-	tcsetattr(tty_fd, TCSAFLUSH, &term); halt_on_error("tcsetattr");
-	term.c_lflag	 = old_clflag;
+	/* open terminal (replay goes without it on headless machines) */
+	tty_fd	= open("/dev/tty", O_RDWR);
+	if (tty_fd < 0 && replay_path)
+		errno = 0;
+	else {
+		halt_on_error("/dev/tty");
+
+		/* set raw mode (and save terminal settings) */
+		tcgetattr(tty_fd, &term); halt_on_error("tcgetattr");
+		old_clflag		 = term.c_lflag;
+		term.c_lflag	&= ~(ICANON | ECHO);
+		tcsetattr(tty_fd, TCSAFLUSH, &term); halt_on_error("tcsetattr");
+		term.c_lflag	 = old_clflag;
+	}
 	
 	/* set signal handlers */
 	signal(SIGINT,  sig_break); ordie("SIGINT");
 	signal(SIGTERM, sig_break); ordie("SIGTERM");
 	signal(SIGABRT, sig_break); ordie("SIGABRT");
 
-	
-	/* open framebuffer */
-	fb_fd	= open("/dev/fb0", O_RDWR | O_NONBLOCK); ordie("/dev/fb0");
-	
-	/* get some info about framebuffer */
-	ioctl(fb_fd, FBIOGET_VSCREENINFO, &varscreeninfo); ordie("varscreen");
-	if (varscreeninfo.type != FB_TYPE_VGA_PLANES)
-		error("This program supports just vga16fb framebuffer");
-	ioctl(fb_fd, FBIOGET_FSCREENINFO, &fixscreeninfo); ordie("fixscreen");
+	/* open framebuffers, displays are placed side by side */
+	wall_blocks = 0;
+	wall_height = 0;
+	for (i=0; i < ndisplays; i++) {
+		d = &displays[i];
+		init_display(d);
+
+		d->wall_x    = wall_blocks;
+		wall_blocks += d->scr_blocks;
+		if (d->scr_height > wall_height)
+			wall_height = d->scr_height;
+	}
 
-	/* map video memory to our memory segment */
-	screen_size = fixscreeninfo.smem_len;
-	screen = mmap((void*)fixscreeninfo.smem_start, screen_size,
-                  PROT_READ|PROT_WRITE, MAP_SHARED, fb_fd, 0);
-	halt_on_error("mmap");
+	/* one render thread per display */
+	if (ndisplays > 1)
+		for (i=0; i < ndisplays; i++)
+			if (pthread_create(&displays[i].thread, NULL, render_thread, &displays[i]) != 0)
+				error("pthread_create failed (render)");
+
+	/* without terminal there is no console to switch or clear */
+	if (tty_fd < 0)
+		return;
 
 	/* take over virtual terminal switching (if we are running in VT) */
 	if (ioctl(tty_fd, VT_GETMODE, &s) == 0) {
@@ -390,21 +1647,137 @@ void init() {
 	printf("\033[2J");
 }
 
-void clean() {
-#if SETMODE
-	/* set console mode (text, rather graphics) */
-	ioctl(tty_fd, KDSETMODE, KD_TEXT);
-#endif
+void init_display(struct display *d) {
+	struct fb_fix_screeninfo fixscreeninfo;
+	struct fb_var_screeninfo varscreeninfo;
+	int bpp;
+
+	d->fd    = -1;
+	d->pages = 1;
+
+	if (strncmp(d->device, "mem:", 4) == 0) {
+		/* memory-backed display (testing, benchmarks) */
+		if (sscanf(d->device + 4, "%dx%dx%d", &d->scr_width, &d->scr_height, &bpp) != 3 ||
+		    d->scr_width < 8 || d->scr_height <= 0 ||
+		    (bpp != 8 && bpp != 16 && bpp != 32))
+			error("Invalid memory display (mem:WIDTHxHEIGHTxBPP, BPP is 8, 16 or 32)");
+
+		d->packed      = true;
+		d->bytespp     = bpp/8;
+		d->scr_blocks  = d->scr_width/8;
+		d->line_length = d->scr_width * d->bytespp;
+		d->fg_pixel    = bpp == 8 ? 15 : (bpp == 16 ? 0xffff : 0xffffff);
+		d->bg_pixel    = 0;
+
+		d->screen_size = d->line_length * d->scr_height;
+		d->screen      = (uint8_t*)calloc(d->screen_size, 1);
+		if (d->screen == NULL) error("malloc failed (display)");
+
+		d->vsync_method = VSYNC_NONE;
+		return;
+	}
 	
-	/* restore terminal mode */
-	tcsetattr(tty_fd, TCSAFLUSH, &term);
+	/* open framebuffer */
+	d->fd = open(d->device, O_RDWR | O_NONBLOCK); ordie(d->device);
 	
-	/* close opened files */
-	close(fb_fd);
-	close(tty_fd);
+	/* get some info about framebuffer */
+	ioctl(d->fd, FBIOGET_VSCREENINFO, &varscreeninfo); ordie("varscreen");
+	ioctl(d->fd, FBIOGET_FSCREENINFO, &fixscreeninfo); ordie("fixscreen");
+	switch (fixscreeninfo.type) {
+		case FB_TYPE_VGA_PLANES:
+			d->packed = false;
+			break;
+		case FB_TYPE_PACKED_PIXELS:
+			d->packed = true;
+			break;
+		default:
+			error("This program supports vga16fb and packed pixels framebuffers");
+	}
+
+	d->scr_width	= varscreeninfo.xres;
+	d->scr_height	= varscreeninfo.yres;
+	d->scr_blocks	= d->scr_width/8;
+	d->line_length	= fixscreeninfo.line_length;
+
+	if (d->packed) {
+		if (varscreeninfo.bits_per_pixel != 8  &&
+		    varscreeninfo.bits_per_pixel != 16 &&
+		    varscreeninfo.bits_per_pixel != 32)
+			error("Only 8, 16 and 32 bpp packed pixels are supported");
+		d->bytespp = varscreeninfo.bits_per_pixel/8;
+		if (d->line_length == 0)
+			d->line_length = varscreeninfo.xres_virtual * d->bytespp;
+
+		/* palette modes use console colors: 0 - black, 15 - bright white */
+		if (fixscreeninfo.visual == FB_VISUAL_TRUECOLOR ||
+		    fixscreeninfo.visual == FB_VISUAL_DIRECTCOLOR) {
+			d->fg_pixel = make_pixel(&varscreeninfo, 0xff, 0xff, 0xff);
+			d->bg_pixel = make_pixel(&varscreeninfo, 0x00, 0x00, 0x00);
+		}
+		else {
+			d->fg_pixel = 15;
+			d->bg_pixel = 0;
+		}
+	}
+	else if (d->line_length == 0)
+		d->line_length = d->scr_blocks;
+
+	setup_pages(d, &varscreeninfo, &fixscreeninfo);
+
+	/* map video memory to our memory segment */
+	d->screen_size = fixscreeninfo.smem_len;
+	d->screen = mmap((void*)fixscreeninfo.smem_start, d->screen_size,
+	                 PROT_READ|PROT_WRITE, MAP_SHARED, d->fd, 0);
+	halt_on_error("mmap");
+
+	vsync_init(d, &varscreeninfo);
+}
 
-	/* and unmap video memory */
-	munmap(screen, screen_size);
+void clean() {
+	struct display *d;
+	int i;
+
+	/* batch didn't touch displays & terminal */
+	if (batch_dir)
+		return;
+
+	/* set console mode (text, rather graphics) */
+	if (session && tty_fd >= 0)
+		ioctl(tty_fd, KDSETMODE, KD_TEXT);
+
+	for (i=0; i < ndisplays; i++) {
+		d = &displays[i];
+		if (d->fd < 0) {
+			free(d->screen);
+			continue;
+		}
+
+		/* show first page again (console draws there) */
+		if (d->pages == 2) {
+			d->panvar.yoffset = 0;
+			ioctl(d->fd, FBIOPAN_DISPLAY, &d->panvar);
+			if (d->var_changed)
+				ioctl(d->fd, FBIOPUT_VSCREENINFO, &d->oldvar);
+			d->pages = 1;
+		}
+
+		/* unmap video memory */
+		munmap(d->screen, d->screen_size);
+		close(d->fd);
+	}
+	
+	/* remove daemon socket */
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(listen_path);
+	}
+
+	if (tty_fd < 0)
+		return;
+
+	/* restore terminal mode */
+	tcsetattr(tty_fd, TCSAFLUSH, &term);
+	close(tty_fd);
 
 	/* ESC [ 2 J -- erase whole screen */
 	printf("\033[2J");
@@ -412,42 +1785,1314 @@ void clean() {
 	printf("\0338");
 }
 
-void show_image(int dx, int dy) {
-	int w, h, y;
-	int screen_offset, image_offset;
+void show_image() {
+	/* VT release (signal) waits until drawing is finished */
+	drawing = 1;
+	if (!vt_active) {
+		stale    = 1;
+		drawing  = 0;
+		return;
+	}
 
-	printf("\033[1m"		/* set bright */
-	       "\033[37m"		/*     white foreground */
-	       "\033[40m"		/* and black background */
-	       " \033[1;1H"		/* move cursor to left upper corner */
-	); fflush(stdout);
+	if (!session && tty_fd >= 0) {
+		printf("\033[1m"		/* set bright */
+		       "\033[37m"		/*     white foreground */
+		       "\033[40m"		/* and black background */
+		       " \033[1;1H"		/* move cursor to left upper corner */
+		); fflush(stdout);
 #ifdef _SETMODE
-	ioctl(tty_fd, KDSETMODE, KD_GRAPHICS);
+		ioctl(tty_fd, KDSETMODE, KD_GRAPHICS);
 #endif
+	}
 
-	h = height > 480 ? 480   : height;
-	w = width  > 640 ? 640/8 : blocks;
+	update_rows(current, dy, dy + wall_height);
+	render(JOB_SHOW, NULL);
+	prerendered = NULL;
 
-	screen_offset = sdy * 640/8 + sdx;
-	image_offset  = dy  * blocks + dx;
-	for (y=0; y<h; y++) {
-		memcpy(&screen[screen_offset], &image[image_offset], w);
+#ifdef _SETMODE
+	if (!session && tty_fd >= 0)
+		ioctl(tty_fd, KDSETMODE, KD_TEXT);
+#endif
 
-		screen_offset += 640/8;
-		image_offset  += blocks;
+	drawing = 0;
+	if (release_pending) {
+		release_pending = 0;
+		release_vt();
 	}
-#ifdef _SETMODE
-	ioctl(tty_fd, KDSETMODE, KD_TEXT);
+}
+
+void render(int job, struct picture *pic) {
+	/* single display is drawn by main thread */
+	if (ndisplays == 1) {
+		render_display(&displays[0], job, pic);
+		return;
+	}
+
+	pthread_mutex_lock(&render_lock);
+	render_job     = job;
+	render_pic     = pic;
+	render_pending = ndisplays;
+	render_serial++;
+	pthread_cond_broadcast(&render_start);
+	while (render_pending > 0)
+		pthread_cond_wait(&render_done, &render_lock);
+	pthread_mutex_unlock(&render_lock);
+}
+
+void render_display(struct display *d, int job, struct picture *pic) {
+	switch (job) {
+		case JOB_SHOW:
+			show_display(d, dx, dy);
+			break;
+		case JOB_PRERENDER:
+			prerender_display(d, pic);
+			break;
+	}
+}
+
+void *render_thread(void *arg) {
+	struct display *d = (struct display*)arg;
+	struct picture *pic;
+	sigset_t set;
+	int serial = 0;
+	int job;
+
+	/* signals (VT switching, Ctrl-C) are handled by main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&render_lock);
+	while (1) {
+		while (render_serial == serial)
+			pthread_cond_wait(&render_start, &render_lock);
+		serial = render_serial;
+		job    = render_job;
+		pic    = render_pic;
+		pthread_mutex_unlock(&render_lock);
+
+		render_display(d, job, pic);
+
+		pthread_mutex_lock(&render_lock);
+		if (--render_pending == 0)
+			pthread_cond_signal(&render_done);
+	}
+
+	return NULL;
+}
+
+void show_display(struct display *d, int dx, int dy) {
+	uint8_t *base;
+
+	if (d->pages == 2) {
+		/* draw on hidden page (unless it's ready), then flip */
+		base = &d->screen[(1 - d->page) * d->page_size];
+		if (prerendered != current || dx != 0 || dy != 0) {
+			if (d->page_dirty[1 - d->page]) {
+				clear_page(d, base);
+				d->page_dirty[1 - d->page] = false;
+			}
+			draw_image(d, base, image, blocks, height, sdx, sdy, dx, dy, false);
+		}
+
+		d->page = 1 - d->page;
+		flip_page(d);
+	}
+	else {
+		/* console erases only its own screen (and not in graphics mode) */
+		if (d->page_dirty[0]) {
+			clear_page(d, d->screen);
+			d->page_dirty[0] = false;
+		}
+		draw_image(d, d->screen, image, blocks, height, sdx, sdy, dx, dy, true);
+	}
+}
+
+void draw_image(struct display *d, uint8_t *base,
+                uint8_t *img, int img_blocks, int img_height,
+                int x, int y, int dx, int dy, bool sync) {
+	int w, h, i, x0, x1;
+	int screen_offset, image_offset;
+
+	/* visible part of image on the wall... */
+	w = img_blocks - dx;
+	h = img_height - dy;
+	if (w > wall_blocks - x) w = wall_blocks - x;
+	if (h > wall_height - y) h = wall_height - y;
+
+	/* ...and on this display */
+	x0 = x > d->wall_x ? x : d->wall_x;
+	x1 = x + w < d->wall_x + d->scr_blocks ? x + w : d->wall_x + d->scr_blocks;
+	if (h > d->scr_height - y) h = d->scr_height - y;
+	if (x1 <= x0 || h <= 0)
+		return;
+
+	w = x1 - x0;
+	image_offset = dy * img_blocks + dx + (x0 - x);
+	x = x0 - d->wall_x;
+
+	if (d->packed) {
+		screen_offset = y * d->line_length + x * 8 * d->bytespp;
+		if (sync) frame_begin(d);
+		for (i=0; i<h; i++) {
+			if (sync) frame_row(d, y + i);
+			expand_row(d, &base[screen_offset], &img[image_offset], w);
+
+			screen_offset += d->line_length;
+			image_offset  += img_blocks;
+		}
+	}
+	else {
+		screen_offset = y * d->line_length + x;
+		if (sync) frame_begin(d);
+		for (i=0; i<h; i++) {
+			if (sync) frame_row(d, y + i);
+			memcpy(&base[screen_offset], &img[image_offset], w);
+
+			screen_offset += d->line_length;
+			image_offset  += img_blocks;
+		}
+	}
+}
+
+void clear_page(struct display *d, uint8_t *base) {
+	uint8_t zero[64];
+	int i, n, y;
+
+	if (!d->packed) {
+		for (y=0; y < d->scr_height; y++)
+			memset(&base[y * d->line_length], 0, d->scr_blocks);
+		return;
+	}
+
+	/* expand the first row, then copy it */
+	memset(zero, 0, sizeof(zero));
+	for (i=0; i < d->scr_blocks; i += n) {
+		n = d->scr_blocks - i;
+		if (n > (int)sizeof(zero))
+			n = sizeof(zero);
+		expand_row(d, &base[i * 8 * d->bytespp], zero, n);
+	}
+
+	for (y=1; y < d->scr_height; y++)
+		memcpy(&base[y * d->line_length], base, d->scr_blocks * 8 * d->bytespp);
+}
+
+void flip_page(struct display *d) {
+	/* change display start during blanking, so the new page
+	   appears at once; some drivers latch the offset, some don't */
+	wait_vsync(d);
+	d->panvar.xoffset = 0;
+	d->panvar.yoffset = d->page * d->scr_height;
+	if (ioctl(d->fd, FBIOPAN_DISPLAY, &d->panvar) < 0) {
+		/* should not happen (checked in setup_pages) */
+		errno = 0;
+		d->pages = 1;
+		d->page  = 0;
+		d->page_dirty[0] = true;
+		refresh = true;
+	}
+}
+
+void prerender(struct picture *pic) {
+	/* VT release (signal) waits as for show_image; framebuffer of
+	   another VT is not touched */
+	drawing = 1;
+	if (!vt_active) {
+		drawing = 0;
+		return;
+	}
+
+	update_rows(pic, 0, wall_height);
+	render(JOB_PRERENDER, pic);
+	prerendered = pic;
+
+	drawing = 0;
+	if (release_pending) {
+		release_pending = 0;
+		release_vt();
+	}
+}
+
+void prerender_display(struct display *d, struct picture *pic) {
+	uint8_t *base;
+	int x, y;
+
+	if (d->pages != 2)
+		return;
+
+	base = &d->screen[(1 - d->page) * d->page_size];
+	clear_page(d, base);
+
+	center_picture(pic, &x, &y);
+	draw_image(d, base, pic->image, pic->blocks, pic->height, x, y, 0, 0, false);
+
+	/* page holds other picture than current: if current is drawn
+	   there instead (invert, scroll...), it must be cleared first */
+	d->page_dirty[1 - d->page] = true;
+}
+
+void setup_pages(struct display *d, struct fb_var_screeninfo *v,
+                 struct fb_fix_screeninfo *f) {
+	d->pages = 1;
+	d->page  = 0;
+
+	/* vga16fb has only 64kB window -- not enough for two 640x480 pages */
+	if (!d->packed || f->ypanstep == 0)
+		return;
+
+	d->oldvar = *v;
+	if (v->yres_virtual < 2*v->yres) {
+		/* unsigned 64-bit: line_length is int and the product may overflow */
+		if (f->smem_len < 2 * (uint64_t)v->yres * (unsigned)d->line_length)
+			return;
+
+		/* ask driver for taller virtual screen */
+		v->yres_virtual = 2*v->yres;
+		if (ioctl(d->fd, FBIOPUT_VSCREENINFO, v) < 0 ||
+		    ioctl(d->fd, FBIOGET_VSCREENINFO, v) < 0 ||
+		    ioctl(d->fd, FBIOGET_FSCREENINFO, f) < 0 ||
+		    v->yres_virtual < 2*v->yres) {
+			errno = 0;
+			ioctl(d->fd, FBIOPUT_VSCREENINFO, &d->oldvar);
+			errno = 0;
+			*v = d->oldvar;
+			return;
+		}
+		d->var_changed = true;
+		if (f->line_length)
+			d->line_length = f->line_length;
+	}
+
+	d->page_size = d->line_length * d->scr_height;
+	if (f->smem_len < 2 * (uint64_t)(unsigned)d->page_size)
+		return;
+
+	/* check if panning works */
+	d->panvar = *v;
+	d->panvar.xoffset = 0;
+	d->panvar.yoffset = 0;
+	if (ioctl(d->fd, FBIOPAN_DISPLAY, &d->panvar) < 0) {
+		errno = 0;
+		return;
+	}
+
+	d->pages = 2;
+	d->page_dirty[0] = d->page_dirty[1] = true;
+}
+
+bool dump_display(struct display *d, char *filename) {
+	uint8_t *row;
+	uint32_t pix;
+	FILE *f;
+	int  x, y;
+
+	f = fopen(filename, "wb");
+	if (f == NULL) {
+		snprintf(error_msg, sizeof(error_msg), "%s: %s", filename, strerror(errno));
+		errno = 0;
+		return false;
+	}
+
+	fprintf(f, "P5\n%d %d\n255\n", d->scr_width, d->scr_height);
+	for (y=0; y < d->scr_height; y++) {
+		row = &d->screen[d->page * d->page_size + y * d->line_length];
+		for (x=0; x < d->scr_width; x++) {
+			if (!d->packed)
+				pix = (row[x/8] >> (7 - x%8)) & 1;
+			else
+				switch (d->bytespp) {
+					case 1:  pix = row[x] == d->fg_pixel; break;
+					case 2:  pix = ((uint16_t*)row)[x] == d->fg_pixel; break;
+					default: pix = ((uint32_t*)row)[x] == d->fg_pixel; break;
+				}
+			fputc(pix ? 255 : 0, f);
+		}
+	}
+
+	fclose(f);
+	return true;
+}
+
+
+/* Each bit of src selects fg_pixel (1) or bg_pixel (0).  SSE2 versions
+   broadcast source byte(s) into all lanes, isolate one bit per lane and
+   turn it into a lane mask with compare. */
+
+void expand_row8(uint8_t *dst, uint8_t *src, int n, uint32_t fg_pixel, uint32_t bg_pixel) {
+	int i, bit;
+#ifdef __SSE2__
+	const __m128i sel = _mm_setr_epi8(
+		(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+		(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	const __m128i bg  = _mm_set1_epi8(bg_pixel);
+	const __m128i xr  = _mm_set1_epi8(fg_pixel ^ bg_pixel);
+	__m128i v, m;
+
+	for (i=0; i+1 < n; i += 2) {
+		v = _mm_unpacklo_epi64(_mm_set1_epi8(src[i]), _mm_set1_epi8(src[i+1]));
+		m = _mm_cmpeq_epi8(_mm_and_si128(v, sel), sel);
+		_mm_storeu_si128((__m128i*)&dst[i*8], _mm_xor_si128(bg, _mm_and_si128(m, xr)));
+	}
+#else
+	i = 0;
 #endif
+	for (; i < n; i++)
+		for (bit=0; bit < 8; bit++)
+			dst[i*8 + bit] = (src[i] & (0x80 >> bit)) ? fg_pixel : bg_pixel;
 }
 
+void expand_row16(uint8_t *dst, uint8_t *src, int n, uint32_t fg_pixel, uint32_t bg_pixel) {
+	uint16_t *pix = (uint16_t*)dst;
+	int i, bit;
+#ifdef __SSE2__
+	const __m128i sel = _mm_setr_epi16(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	const __m128i bg  = _mm_set1_epi16(bg_pixel);
+	const __m128i xr  = _mm_set1_epi16(fg_pixel ^ bg_pixel);
+	__m128i m;
+
+	for (i=0; i < n; i++) {
+		m = _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16(src[i]), sel), sel);
+		_mm_storeu_si128((__m128i*)&pix[i*8], _mm_xor_si128(bg, _mm_and_si128(m, xr)));
+	}
+#else
+	i = 0;
+#endif
+	for (; i < n; i++)
+		for (bit=0; bit < 8; bit++)
+			pix[i*8 + bit] = (src[i] & (0x80 >> bit)) ? fg_pixel : bg_pixel;
+}
+
+void expand_row32(uint8_t *dst, uint8_t *src, int n, uint32_t fg_pixel, uint32_t bg_pixel) {
+	uint32_t *pix = (uint32_t*)dst;
+	int i, bit;
+#ifdef __SSE2__
+	const __m128i sel_hi = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+	const __m128i sel_lo = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+	const __m128i bg = _mm_set1_epi32(bg_pixel);
+	const __m128i xr = _mm_set1_epi32(fg_pixel ^ bg_pixel);
+	__m128i v, m0, m1;
+
+	for (i=0; i < n; i++) {
+		v  = _mm_set1_epi32(src[i]);
+		m0 = _mm_cmpeq_epi32(_mm_and_si128(v, sel_hi), sel_hi);
+		m1 = _mm_cmpeq_epi32(_mm_and_si128(v, sel_lo), sel_lo);
+		_mm_storeu_si128((__m128i*)&pix[i*8 + 0], _mm_xor_si128(bg, _mm_and_si128(m0, xr)));
+		_mm_storeu_si128((__m128i*)&pix[i*8 + 4], _mm_xor_si128(bg, _mm_and_si128(m1, xr)));
+	}
+#else
+	i = 0;
+#endif
+	for (; i < n; i++)
+		for (bit=0; bit < 8; bit++)
+			pix[i*8 + bit] = (src[i] & (0x80 >> bit)) ? fg_pixel : bg_pixel;
+}
+
+void expand_row(struct display *d, uint8_t *dst, uint8_t *src, int n) {
+	switch (d->bytespp) {
+		case 1: expand_row8(dst, src, n, d->fg_pixel, d->bg_pixel);  break;
+		case 2: expand_row16(dst, src, n, d->fg_pixel, d->bg_pixel); break;
+		case 4: expand_row32(dst, src, n, d->fg_pixel, d->bg_pixel); break;
+	}
+}
+
+
+/* cache *********************************************************/
+
+struct picture *load_picture(char *filename) {
+	struct picture * volatile pic = NULL;	/* kept across longjmp */
+	FILE * volatile f = NULL;
+	jmp_buf env;
+	int     i;
+
+	/* set before anything can call error() -- batch worker must not exit */
+	recover = &env;
+	if (setjmp(env)) {
+		recover = NULL;
+		if (pic) {
+			arena_free(pic->image);
+			free(pic);
+		}
+		if (f)
+			fclose(f);
+		return NULL;
+	}
+
+	pic = (struct picture*)calloc(1, sizeof(struct picture));
+	if (pic == NULL) error("malloc failed (picture)");
+
+	f = open_input(filename);
+	if (f == NULL) {
+		snprintf(error_msg, sizeof(error_msg), "%s: %s", filename, strerror(errno));
+		errno = 0;
+		recover = NULL;
+		free(pic);
+		return NULL;
+	}
+
+	read_pgm(f, pic);
+	for (i=0; i < ntransforms; i++)
+		if (!transform_picture(pic, transforms[i]))
+			error("not enough memory for rotation (see -m)");
+	recover = NULL;
+	fclose(f);
+
+	pic->name = strdup(filename);
+	return pic;
+}
+
+void free_picture(struct picture *pic) {
+	free(pic->name);
+	arena_free(pic->image);
+	free(pic);
+}
+
+char *canonical_path(char *path) {
+	char *name;
+
+	name = realpath(path, NULL);
+	errno = 0;
+	return name ? name : strdup(path);
+}
+
+struct picture *get_picture(char *filename) {
+	struct picture *pic, *prev;
+	double t;
+	char   *name;
+
+	t = now_ms();
+
+	name = canonical_path(filename);
+	if (name == NULL) {
+		snprintf(error_msg, sizeof(error_msg), "malloc failed (name)");
+		return NULL;
+	}
+
+	/* lookup */
+	for (prev = NULL, pic = cache; pic; prev = pic, pic = pic->next)
+		if (strcmp(pic->name, name) == 0)
+			break;
+
+	if (pic) {
+		/* move to front */
+		if (prev) {
+			prev->next = pic->next;
+			pic->next  = cache;
+			cache      = pic;
+		}
+		stats.hits++;
+	}
+	else {
+		pic = load_picture(name);
+		if (pic == NULL) {
+			free(name);
+			return NULL;
+		}
+
+		/* images were evicted before allocation (cache_reclaim) */
+		pic->next   = cache;
+		cache       = pic;
+		cache_entries++;
+		stats.loads++;
+	}
+
+	free(name);
+	stats.load_ms = now_ms() - t;
+	return pic;
+}
+
+void cache_reclaim(size_t size) {
+	struct picture *prev, *victim, *victim_prev;
+
+	while (arena_used + size > arena_budget) {
+		victim = victim_prev = NULL;
+		for (prev = cache; prev && prev->next; prev = prev->next)
+			if (prev->next != current) {
+				victim_prev = prev;
+				victim      = prev->next;
+			}
+		if (victim == NULL)
+			break;
+
+		victim_prev->next = victim->next;
+		if (victim == prerendered)
+			prerendered = NULL;
+		cache_entries--;
+		free_picture(victim);
+	}
+}
+
+void select_picture(struct picture *pic) {
+	int i;
+
+	if (pic == NULL)
+		return;
+
+	current = pic;
+	image   = pic->image;
+	width   = pic->width;
+	blocks  = pic->blocks;
+	height  = pic->height;
+
+	center_picture(pic, &sdx, &sdy);
+
+	dx = dy = 0;
+	refresh = true;
+	for (i=0; i < ndisplays; i++)
+		displays[i].page_dirty[0] = displays[i].page_dirty[1] = true;
+
+	/* ESC [ 2 J -- erase whole screen (previous image could be larger) */
+	if (!session && tty_fd >= 0) {
+		printf("\033[2J");
+		fflush(stdout);
+	}
+}
+
+void center_picture(struct picture *pic, int *x, int *y) {
+	/* center horizontal */
+	if (pic->blocks < wall_blocks)
+		*x = (wall_blocks - pic->blocks)/2;
+	else
+		*x = 0;
+	
+	/* center verical */
+	if (pic->height < wall_height)
+		*y = (wall_height - pic->height)/2;
+	else
+		*y = 0;
+}
+
+bool redraw() {
+	static int pdx = -1, pdy = -1;
+	double t;
+
+	if (stale && vt_active) {
+		stale   = 0;
+		refresh = true;
+	}
+
+	if (current && (refresh || pdx != dx || pdy != dy)) {
+		t = now_ms();
+		show_image();
+		stats.show_ms = now_ms() - t;
+
+		pdx = dx;
+		pdy = dy;
+		refresh = false;
+		return true;
+	}
+	return false;
+}
+
+/* batch ***********************************************************/
+
+bool batch_picture(struct job *job, FILE *f) {
+	struct picture *pic;
+	bool ok;
+
+	pic = load_picture(job->path);
+	if (pic == NULL)
+		return false;
+
+	ok = write_pbm(pic, f);
+	if (ok) {
+		job->pixels = (double)pic->width * pic->height;
+		snprintf(job->info, sizeof(job->info), "%dx%d", pic->width, pic->height);
+	}
+	free_picture(pic);
+	return ok;
+}
+
+/* key trace *******************************************************/
+
+/* Key traces.  Line of trace is "ms key" -- time since start and key, a
+   character or its code (0x0a, 10); lines starting with # are comments.
+   Replay sends keys at their times through the same process_key & redraw
+   as keyboard does.  If the previous frame isn't finished yet, key waits
+   (like in terminal buffer) and the wait is a part of its latency. */
+
+bool load_trace(char *path) {
+	char   line[256], key[32], *e;
+	double time, last = 0.0;
+	FILE   *f;
+	int    n, c;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		printf("%s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	for (n=1; fgets(line, sizeof(line), f); n++) {
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0)
+			continue;
+
+		c = sscanf(line, "%lf %31s", &time, key);
+		if (c == 2 && strlen(key) == 1)
+			c = (unsigned char)key[0];
+		else if (c == 2) {
+			c = strtol(key, &e, 0);
+			if (*e != 0)
+				c = -1;
+		}
+		else
+			c = -1;
+
+		if (c < 0 || c > 255 || time < last) {
+			printf("%s:%d: invalid key event\n", path, n);
+			fclose(f);
+			return false;
+		}
+		last = time;
+
+		if ((trace_len & (trace_len - 1)) == 0) {
+			trace = (struct key_event*)realloc(trace, (trace_len ? 2*trace_len : 64) * sizeof(struct key_event));
+			if (trace == NULL) {
+				puts("malloc failed (trace)");
+				fclose(f);
+				return false;
+			}
+		}
+		trace[trace_len].time    = time;
+		trace[trace_len].key     = c;
+		trace[trace_len].latency = 0.0;
+		trace_len++;
+	}
+
+	fclose(f);
+	return true;
+}
+
+void record_key(double time, int key, double latency) {
+	if (key == EOF)
+		return;
+
+	if (key > ' ' && key < 127)
+		fprintf(record_file, "%.1f %c", time, key);
+	else
+		fprintf(record_file, "%.1f 0x%02x", time, key & 0xff);
+
+	if (latency >= 0.0)
+		fprintf(record_file, " %.3f", latency);
+	fputc('\n', record_file);
+}
+
+void replay() {
+	struct key_event *ev;
+	struct timespec ts;
+	double due;
+	bool   quit = false;
+	int    i;
+
+	redraw();		/* the first frame isn't measured */
+
+	trace_start = now_ms();
+	for (i=0; i < trace_len && !quit; i++) {
+		ev  = &trace[i];
+		due = trace_start + ev->time;
+
+		/* sleep until key time (clock of now_ms) */
+		ts.tv_sec  = (time_t)(due / 1000.0);
+		ts.tv_nsec = (long)((due - ts.tv_sec * 1000.0) * 1000000.0);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+
+		/* keys drawing nothing (q, scroll at the edge) would only
+		   lower the percentiles */
+		quit = process_key(ev->key);
+		if (redraw())
+			ev->latency = now_ms() - due;
+		else
+			ev->latency = -1.0;
+
+		if (record_file)
+			record_key(ev->time, ev->key, ev->latency);
+	}
+
+	trace_len = i;
+	trace_ms  = now_ms() - trace_start;
+}
+
+int latency_compare(const void *a, const void *b) {
+	double la = *(double*)a;
+	double lb = *(double*)b;
+
+	return (la > lb) - (la < lb);
+}
+
+/* prints distribution of n latencies (v gets sorted) */
+void report_line(char *label, double *v, int n) {
+	double sum = 0.0;
+	int    i;
+
+	qsort(v, n, sizeof(double), latency_compare);
+	for (i=0; i < n; i++)
+		sum += v[i];
+
+	/* percentiles: nearest rank */
+	printf("%-6s %6d %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n",
+	       label, n, v[0],
+	       v[(50*n + 99)/100 - 1], v[(90*n + 99)/100 - 1], v[(99*n + 99)/100 - 1],
+	       v[n - 1], sum / n);
+}
+
+void replay_report() {
+	double *v;
+	char   label[8];
+	int    i, k, n;
+
+	if (trace_len == 0) {
+		puts("replay: no keys");
+		return;
+	}
+
+	v = (double*)malloc(trace_len * sizeof(double));
+	if (v == NULL) {
+		puts("malloc failed (report)");
+		return;
+	}
+
+	for (i=n=0; i < trace_len; i++)
+		if (trace[i].latency >= 0.0)
+			v[n++] = trace[i].latency;
+
+	printf("replay: %d keys in %.1f ms, %d drew no frame\n",
+	       trace_len, trace_ms, trace_len - n);
+	if (n == 0) {
+		free(v);
+		return;
+	}
+
+	printf("latency from key to frame completion (ms):\n"
+	       "key         n      min      p50      p90      p99      max     mean\n");
+	report_line("all", v, n);
+
+	for (k=0; k < 256; k++) {
+		for (i=n=0; i < trace_len; i++)
+			if (trace[i].key == k && trace[i].latency >= 0.0)
+				v[n++] = trace[i].latency;
+		if (n == 0)
+			continue;
+
+		if (k > ' ' && k < 127)
+			snprintf(label, sizeof(label), "%c", k);
+		else
+			snprintf(label, sizeof(label), "0x%02x", k);
+		report_line(label, v, n);
+	}
+
+	free(v);
+}
+
+/* daemon **********************************************************/
+
+#define MAX_CLIENTS	8
+
+struct client {
+	int  fd;
+	int  len;
+	char buf[PATH_MAX + 64];
+} clients[MAX_CLIENTS];
+
+void daemon_init(char *path) {
+	struct sockaddr_un addr;
+	int i;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		error("Socket path is too long");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* remove stale socket */
+	unlink(path);
+	errno = 0;
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0); ordie("socket");
+	bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)); ordie(path);
+	listen_path = path;
+	chmod(path, 0600); ordie("chmod");
+	listen(listen_fd, MAX_CLIENTS); ordie("listen");
+
+	/* client could disconnect before reply is sent */
+	signal(SIGPIPE, SIG_IGN); ordie("SIGPIPE");
+
+	for (i=0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+}
+
+void reply(int fd, char *fmt, ...) {
+	char buf[512];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (n >= (int)sizeof(buf))
+		n = sizeof(buf) - 1;
+	send(fd, buf, n, MSG_NOSIGNAL);
+}
+
+/* shows picture of playlist entry pos (already got by get_picture) */
+void playlist_show(int pos, struct picture *pic) {
+	playlist_pos = pos;
+	select_picture(pic);
+	want_prerender = true;
+}
+
+/* executes single command, returns true on quit */
+bool execute_command(int fd, char *cmd) {
+	struct picture *pic;
+	char   *arg, **list, *name;
+	int    i, n, x, y;
+	int    ops[MAX_TRANSFORMS];
+
+	arg = strchr(cmd, ' ');
+	if (arg)
+		*arg++ = 0;
+
+	if (strcmp(cmd, "load") == 0 && arg) {
+		pic = get_picture(arg);
+		if (pic == NULL) {
+			reply(fd, "error: %s\n", error_msg);
+			return false;
+		}
+
+		/* find file on playlist or append it (names are canonical) */
+		for (i=0; i < playlist_len; i++)
+			if (strcmp(playlist[i], pic->name) == 0)
+				break;
+
+		if (i == playlist_len) {
+			list = (char**)realloc(playlist, (playlist_len + 1) * sizeof(char*));
+			name = strdup(pic->name);
+			if (list == NULL || name == NULL) {
+				if (list)
+					playlist = list;
+				free(name);
+				reply(fd, "error: malloc failed\n");
+				return false;
+			}
+			playlist = list;
+			playlist[playlist_len++] = name;
+		}
+		playlist_show(i, pic);
+	}
+	else if (strcmp(cmd, "next") == 0 || strcmp(cmd, "prev") == 0) {
+		if (playlist_len == 0) {
+			reply(fd, "error: playlist is empty\n");
+			return false;
+		}
+		if (cmd[0] == 'n')
+			i = (playlist_pos + 1) % playlist_len;
+		else
+			i = (playlist_pos + playlist_len - 1) % playlist_len;
+
+		pic = get_picture(playlist[i]);
+		if (pic == NULL) {
+			playlist_pos = i; /* skip broken file next time */
+			reply(fd, "error: %s\n", error_msg);
+			return false;
+		}
+		playlist_show(i, pic);
+	}
+	else if (strcmp(cmd, "scroll") == 0 && arg &&
+	         sscanf(arg, "%d %d", &x, &y) == 2) {
+		/* x, y -- image coordinates (in pixels) */
+		dx = x/8;
+		dy = y;
+		if (dx > blocks - wall_blocks) dx = blocks - wall_blocks;
+		if (dy > height - wall_height) dy = height - wall_height;
+		if (dx < 0) dx = 0;
+		if (dy < 0) dy = 0;
+	}
+	else if (strcmp(cmd, "invert") == 0) {
+		if (current) {
+			invert_image();
+			refresh = true;
+		}
+	}
+	else if (strcmp(cmd, "rotate") == 0 && arg) {
+		n = parse_transforms(arg, ops);
+		if (n < 0) {
+			reply(fd, "error: invalid rotation\n");
+			return false;
+		}
+		for (i=0; i < n; i++)
+			if (!transform_image(ops[i])) {
+				reply(fd, "error: malloc failed\n");
+				return false;
+			}
+	}
+	else if (strcmp(cmd, "threshold") == 0 && arg &&
+	         sscanf(arg, "%d", &i) == 1) {
+		if (!set_threshold(i)) {
+			reply(fd, "error: source is not kept (option -k)\n");
+			return false;
+		}
+	}
+	else if (strcmp(cmd, "refresh") == 0)
+		refresh = true;
+	else if (strcmp(cmd, "stats") == 0) {
+		reply(fd, "file=%s size=%dx%d position=%d,%d "
+		          "cached=%d cache_bytes=%zu peak_bytes=%zu loads=%d hits=%d "
+		          "load_ms=%.3f show_ms=%.3f displays=%d wall=%dx%d "
+		          "threshold=%d\n",
+		      current ? current->name : "-", width, height, dx*8, dy,
+		      cache_entries, arena_used, arena_peak, stats.loads, stats.hits,
+		      stats.load_ms, stats.show_ms,
+		      ndisplays, wall_blocks*8, wall_height,
+		      current && current->gray ? current->level : -1);
+		return false;
+	}
+	else if (strcmp(cmd, "dump") == 0 && arg &&
+	         sscanf(arg, "%d %n", &i, &x) == 1 && arg[x]) {
+		/* dump display file -- for memory-backed displays mostly */
+		if (i < 0 || i >= ndisplays) {
+			reply(fd, "error: no such display\n");
+			return false;
+		}
+		if (!dump_display(&displays[i], &arg[x])) {
+			reply(fd, "error: %s\n", error_msg);
+			return false;
+		}
+	}
+	else if (strcmp(cmd, "quit") == 0) {
+		reply(fd, "ok\n");
+		return true;
+	}
+	else {
+		reply(fd, "error: unknown command\n");
+		return false;
+	}
+
+	/* show result before reply, so client knows image is displayed */
+	redraw();
+	reply(fd, "ok\n");
+	return false;
+}
+
+void daemon_loop() {
+	struct pollfd fds[2 + MAX_CLIENTS];
+	struct client *c;
+	struct picture *pic;
+	bool quit = false;
+	char key, *eol;
+	int  i, n, fd, hits;
+	double load_ms;
+
+	while (!quit) {
+		redraw();
+
+		/* slideshow: decode next image and draw it on hidden pages,
+		   then "next" command is just a page flip */
+		if (want_prerender && playlist_len > 1) {
+			/* prefetch is not a request: keep stats of the shown image */
+			hits    = stats.hits;
+			load_ms = stats.load_ms;
+			i   = (playlist_pos + 1) % playlist_len;
+			pic = get_picture(playlist[i]);
+			stats.hits    = hits;
+			stats.load_ms = load_ms;
+			if (pic && pic != current)
+				prerender(pic);
+		}
+		want_prerender = false;
+
+		fds[0].fd     = tty_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd     = listen_fd;
+		fds[1].events = POLLIN;
+		for (i=0; i < MAX_CLIENTS; i++) {
+			fds[2 + i].fd     = clients[i].fd;	/* -1 is ignored */
+			fds[2 + i].events = POLLIN;
+		}
+
+		if (poll(fds, 2 + MAX_CLIENTS, -1) < 0) {
+			if (errno == EINTR) { /* VT switch */
+				errno = 0;
+				continue;
+			}
+			halt_on_error("poll");
+		}
+
+		/* keyboard */
+		if (fds[0].revents & POLLIN)
+			if (read(tty_fd, &key, 1) == 1)
+				quit = process_key(key);
+
+		/* new connection */
+		if (fds[1].revents & POLLIN) {
+			fd = accept(listen_fd, NULL, NULL);
+			if (fd >= 0) {
+				for (i=0; i < MAX_CLIENTS; i++)
+					if (clients[i].fd < 0)
+						break;
+				if (i < MAX_CLIENTS) {
+					clients[i].fd  = fd;
+					clients[i].len = 0;
+				}
+				else {
+					reply(fd, "error: too many clients\n");
+					close(fd);
+				}
+			}
+			errno = 0;
+		}
+
+		/* commands (one per line) */
+		for (i=0; i < MAX_CLIENTS && !quit; i++) {
+			c = &clients[i];
+			if (c->fd < 0 || !(fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			n = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+			if (n <= 0) {
+				close(c->fd);
+				c->fd = -1;
+				errno = 0;
+				continue;
+			}
+			c->len += n;
+
+			while (!quit && (eol = memchr(c->buf, '\n', c->len))) {
+				*eol = 0;
+				quit = execute_command(c->fd, c->buf);
+				c->len -= eol + 1 - c->buf;
+				memmove(c->buf, eol + 1, c->len);
+			}
+
+			if (c->len == sizeof(c->buf) - 1) {
+				reply(c->fd, "error: command is too long\n");
+				close(c->fd);
+				c->fd = -1;
+			}
+		}
+	}
+}
+
+int client(char *path, int argc, char *argv[]) {
+	struct sockaddr_un addr;
+	char  cmd[PATH_MAX + 64], buf[512];
+	char  *file;
+	int   fd, i, n, len;
+	bool  failed = false;
+
+	if (argc < 1)
+		usage();
+
+	/* daemon has its own working directory */
+	len = snprintf(cmd, sizeof(cmd), "%s", argv[0]);
+	for (i=1; i < argc; i++) {
+		file = NULL;
+		if (strcmp(argv[0], "load") == 0)
+			file = realpath(argv[i], NULL);
+		len += snprintf(cmd + len, sizeof(cmd) - len, " %s", file ? file : argv[i]);
+		free(file);
+	}
+	if (len >= (int)sizeof(cmd) - 1) {
+		puts("Command is too long");
+		return EXIT_FAILURE;
+	}
+	cmd[len++] = '\n';
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		puts("Socket path is too long");
+		return EXIT_FAILURE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		printf("%s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (write(fd, cmd, len) != len) {
+		printf("%s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	shutdown(fd, SHUT_WR);
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (strncmp(buf, "error", 5) == 0)
+			failed = true;
+		fwrite(buf, n, 1, stdout);
+	}
+	close(fd);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/* Vertical retrace.  Updates start just after retrace and go down the
+   screen ahead of the beam; when the beam catches up, the rest of rows
+   waits for the next retrace.  So no row is ever changed while it is
+   displayed, and large updates are spread across several frames. */
+
+void vsync_init(struct display *d, struct fb_var_screeninfo *v) {
+	__u32  crtc = 0;
+	double t;
+	int    i;
+
+	/* the driver can wait for us... */
+	if (ioctl(d->fd, FBIO_WAITFORVSYNC, &crtc) == 0)
+		d->vsync_method = VSYNC_IOCTL;
+	/* ...or we poll VGA input status register */
+	else if (!d->packed && ioperm(INPUT_STATUS_1, 1, 1) == 0)
+		d->vsync_method = VSYNC_PORT;
+	else
+		d->vsync_method = VSYNC_NONE;
+	errno = 0;
+
+	if (d->vsync_method == VSYNC_NONE)
+		return;
+
+	/* scanlines per frame (with blanking) */
+	d->total_lines = v->yres + v->upper_margin +
+	                 v->lower_margin + v->vsync_len;
+	d->first_line  = v->upper_margin + v->vsync_len;
+	if (d->total_lines <= (int)v->yres) {
+		/* timings unknown, assume VGA-like */
+		d->total_lines = v->yres * 525 / 480;
+		d->first_line  = v->yres * 35 / 480;
+	}
+
+	/* measure refresh period */
+	wait_vsync(d);
+	t = d->vsync_time;
+	for (i=0; i < 4; i++)
+		wait_vsync(d);
+	d->frame_ms = (d->vsync_time - t) / 4;
+
+	if (d->frame_ms < 5.0 || d->frame_ms > 100.0) /* retrace doesn't work */
+		d->vsync_method = VSYNC_NONE;
+}
+
+void wait_vsync(struct display *d) {
+	__u32  crtc = 0;
+	double t;
+
+	switch (d->vsync_method) {
+		case VSYNC_IOCTL:
+			ioctl(d->fd, FBIO_WAITFORVSYNC, &crtc);
+			break;
+
+		case VSYNC_PORT:
+			/* wait for end of current retrace, then for the next one
+			   (at most 100ms -- just in case) */
+			t = now_ms();
+			while ((inb(INPUT_STATUS_1) & 0x08) && now_ms() - t < 100.0)
+				;
+			while (!(inb(INPUT_STATUS_1) & 0x08) && now_ms() - t < 100.0)
+				;
+			break;
+
+		default:
+			return;
+	}
+
+	d->vsync_time = now_ms();
+}
+
+int beam_line(struct display *d) {
+	double lines;
+
+	lines = (now_ms() - d->vsync_time) / d->frame_ms * d->total_lines;
+	return (int)lines % d->total_lines - d->first_line;
+}
+
+void frame_begin(struct display *d) {
+	wait_vsync(d);
+}
+
+void frame_row(struct display *d, int row) {
+	if (d->vsync_method != VSYNC_NONE && beam_line(d) >= row - 1)
+		wait_vsync(d);
+}
+
+
+void session_begin() {
+	struct display *d;
+	int i;
+
+	/* console must not draw (cursor, messages) over image */
+	if (tty_fd >= 0) {
+		ioctl(tty_fd, KDSETMODE, KD_GRAPHICS); ordie("KD_GRAPHICS");
+	}
+
+	for (i=0; i < ndisplays; i++) {
+		d = &displays[i];
+		d->shadow = (uint8_t*)malloc(d->scr_height * d->line_length);
+		if (d->shadow == NULL) error("malloc failed (shadow)");
+
+		d->page_dirty[0] = d->page_dirty[1] = true;
+	}
+}
 
 void vt_activate(int dummy) {
-	show_image(dx, dy);
+	struct display *d;
+	int i;
+
+	/* drawing is not async-signal-safe (render threads, stdio) -- main
+	   loop redraws once getchar/poll is interrupted by this signal */
+	if (!session) {
+		ioctl(tty_fd, VT_RELDISP, VT_ACKACQ);
+
+		/* console has drawn over both pages */
+		for (i=0; i < ndisplays; i++)
+			displays[i].page_dirty[0] = displays[i].page_dirty[1] = true;
+		prerendered = NULL;
+		vt_active   = 1;
+		stale       = 1;
+		return;
+	}
+
 	ioctl(tty_fd, VT_RELDISP, VT_ACKACQ);
+
+	for (i=0; i < ndisplays; i++) {
+		d = &displays[i];
+
+		/* console could pan the other page in */
+		if (d->pages == 2) {
+			d->panvar.xoffset = 0;
+			d->panvar.yoffset = d->page * d->scr_height;
+			ioctl(d->fd, FBIOPAN_DISPLAY, &d->panvar);
+
+			d->page_dirty[1 - d->page] = true;
+			prerendered = NULL;
+		}
+
+		/* one bulk copy instead of rendering image again */
+		memcpy(&d->screen[d->page * d->page_size], d->shadow,
+		       d->scr_height * d->line_length);
+	}
+	vt_active = 1;
+	/* if image was changed (daemon), stale is set -- redraw() handles it */
 }
 
 void vt_release(int dummy) {
+	if (drawing)
+		release_pending = 1;
+	else
+		release_vt();
+}
+
+void release_vt() {
+	struct display *d;
+	int i;
+
+	/* without session console redraws itself, image is drawn again */
+	for (i=0; session && i < ndisplays; i++) {
+		d = &displays[i];
+		memcpy(d->shadow, &d->screen[d->page * d->page_size],
+		       d->scr_height * d->line_length);
+	}
+	vt_active = 0;
 	ioctl(tty_fd, VT_RELDISP, 1);
 }
 
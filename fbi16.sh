@@ -2,6 +2,13 @@
 
 if [ -e $1 ]
 then
+	case $1 in
+		*.pgm.gz|*.pgm.zst)
+			# compressed files are read directly, others (plain too) are
+			# quantized and cached below
+			exec fbi16.bin $1
+			;;
+	esac
 	f=/tmp/`basename $1`.pgm
 	if [ $1 -nt $f ]
 	then
@@ -6,9 +6,29 @@
 	license BSD
 
 	compile:
-		gcc -O2 fbi16.c -o fbi16.bin
+		gcc -O2 -pthread fbi16_2.c fbi16_common.c -o fbi16_2.bin -lz
+	or (zstd support):
+		gcc -O2 -pthread -DHAVE_ZSTD fbi16_2.c fbi16_common.c -o fbi16_2.bin -lz -lzstd
 
 Changelog:
+	18.10.2026
+		- packed pixels framebuffers (8, 16 and 32 bpp)
+		- fixed color index returned for newly allocated colors
+		- read file in separate thread
+		- no flickering: planes are written directly (write mode 0)
+		  in sync with vertical retrace
+		- double buffering (packed pixels framebuffers)
+		- graphics session (-g): console stays in graphics mode,
+		  screen is saved on VT switch and restored on return
+		- read gzip & zstd compressed files (parts of file are
+		  decompressed in parallel), read PPM files
+		- rotation & mirroring (-r, keys), done on packed bits
+		- planes in one arena (huge pages for large images), memory
+		  limit (-m)
+		- batch conversion to planar files (-b) on work-stealing
+		  thread pool, planar files are displayed without quantization
+		- input, image storage, rotations and batch pool shared with
+		  fbi16 (fbi16_common.c)
 	15.10.2006
 		- center images
 	13.10.2006
@@ -34,16 +54,26 @@ Changelog:
 #include <unistd.h>
 #include <termios.h>
 #include <signal.h>
+#include <setjmp.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/io.h>
 
 #include <linux/fb.h>
 #include <linux/kd.h>
 #include <linux/vt.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
+
 
 #define _SETMODE
 
@@ -51,31 +81,76 @@ Changelog:
 #define CTRL_DATA	0x3cf
 #define SEQ_IDX		0x3c4
 #define SEQ_DATA	0x3c5
+#define INPUT_STATUS_1	0x3da
 
-typedef char bool;
-#define false 0
-#define true  1
+#include "fbi16_common.h"
 
 #include <errno.h>
 extern int errno;
 
 uint8_t *screen;		/* framebuffer memory */
 int      screen_size;	/* its size in bytes */
-
-uint8_t *plane0;		/* b/w image (splitted into planes) */
-uint8_t *plane1;		/* b/w image */
-uint8_t *plane2;		/* b/w image */
-uint8_t *plane3;		/* b/w image */
-
-int width;				/* image width */
-int blocks;				/* rounded up width/8 */
-int height;				/* image height */
+int      scr_width;		/* visible area (in pixels) */
+int      scr_height;
+int      scr_blocks;	/* scr_width/8 */
+int      line_length;	/* framebuffer line (in bytes) */
+
+bool     packed;		/* packed pixels framebuffer (efifb, simplefb, ...) */
+int      bytespp;		/* bytes per pixel (packed mode) */
+uint32_t palette[16];	/* pixel values of LUT colors (packed mode) */
+
+struct fb_fix_screeninfo fixscreeninfo;
+struct fb_var_screeninfo varscreeninfo;
+
+/* vertical retrace */
+enum {
+	VSYNC_NONE,
+	VSYNC_IOCTL,		/* FBIO_WAITFORVSYNC */
+	VSYNC_PORT			/* polling VGA input status register */
+};
+
+int    vsync_method;
+double vsync_time;		/* when the last retrace started (ms) */
+double frame_ms;		/* refresh period */
+int    total_lines;		/* scanlines per frame (with blanking) */
+int    first_line;		/* the first visible scanline after retrace */
+
+/* double buffering -- second page below the visible one */
+int  pages;				/* 2 if off-screen page is available */
+int  page;				/* displayed page */
+int  page_size;			/* in bytes */
+bool page_dirty[2];		/* page must be cleared before drawing */
+bool var_changed;		/* yres_virtual was changed */
+struct fb_var_screeninfo panvar;	/* for FBIOPAN_DISPLAY */
+struct fb_var_screeninfo oldvar;	/* settings restored on exit */
+
+/* graphics session -- KD_GRAPHICS is set once, not on every redraw */
+bool session;
+uint8_t *shadow;				/* copy of screen while VT is released */
+volatile sig_atomic_t vt_active = 1;
+volatile sig_atomic_t drawing;			/* show_image is writing to screen */
+volatile sig_atomic_t release_pending;	/* VT release waits for drawing */
+
+/* image -- per thread, batch workers (option -b) load images in parallel */
+__thread uint8_t *plane0;	/* b/w image (splitted into planes, one arena) */
+__thread uint8_t *plane1;	/* b/w image */
+__thread uint8_t *plane2;	/* b/w image */
+__thread uint8_t *plane3;	/* b/w image */
+
+__thread int width;		/* image width */
+__thread int blocks;	/* rounded up width/8 */
+__thread int height;	/* image height */
 int dx, dy;				/* coordinates of left upper corner of displayed
                            image's portion */
 
 int sdx, sdy;
 
-uint8_t LUT[16][3];
+__thread uint8_t LUT[16][3];
+__thread int     total_colors;
+
+/* rotations & mirrors applied (in order) to image -- option -r */
+int  transforms[MAX_TRANSFORMS];
+int  ntransforms;
 
 /* initialzes program: opens files, registers signal handlers, etc. */
 void init();
@@ -89,8 +164,75 @@ void show_image(int dx, int dy);
 /* reads RGB file */
 void read_raw(FILE *f);
 
-void halt_on_error(char*);
-#define ordie halt_on_error
+/* reads header of PPM or planar file (sets width & height), returns
+   format: 6 -- PPM, 16 -- planar */
+int read_header(FILE *f);
+
+/* reads planar file (LUT & planes, as written by write_planar) */
+void read_planar(FILE *f);
+
+/* writes LUT & planes; on error returns false (message is in error_msg) */
+bool write_planar(FILE *f);
+
+/* loads PPM or planar file and applies option -r; on error returns false
+   (message is in error_msg) */
+bool load_image(char *filename);
+
+/* calculates pixel values of LUT colors and selects expand_row */
+void setup_palette();
+
+/* expands n blocks of planes (starting at offset) into packed pixels */
+void (*expand_row)(uint8_t *dst, int offset, int n);
+
+/* detects retrace method and measures refresh rate */
+void vsync_init();
+
+/* waits for the start of vertical retrace */
+void wait_vsync();
+
+/* estimated screen row being displayed (negative in blanking) */
+int beam_line();
+
+/* frame scheduling: frame_begin is called before update, frame_row
+   before each updated screen row */
+void frame_begin();
+void frame_row(int row);
+
+/* enables double buffering if framebuffer has memory for two pages */
+void setup_pages();
+
+/* fills page with background color */
+void clear_page(uint8_t *base);
+
+/* makes hidden page visible */
+void flip_page();
+
+/* computes position of centered image (sdx, sdy) */
+void center_image();
+
+/* rotates or mirrors image planes (TRANSFORM_*); false if out of memory
+   (image is left unchanged) */
+bool transform_planes(int op);
+
+/* transform_planes & centers image on screen again (keys); if image
+   can't be transformed, rings the bell and returns false */
+bool transform_image(int op);
+
+/* allocates arena for planes of width x height image; false if it
+   doesn't fit into memory (planes are left unchanged) */
+bool alloc_planes(int width, int height);
+
+/* switches console to graphics mode for the whole run */
+void session_begin();
+
+/* loads LUT into hardware palette (palette modes) */
+void set_cmap();
+
+/* saves screen into shadow buffer and allows VT switch */
+void release_vt();
+
+/* copies shadow buffer back to screen */
+void restore_screen();
 
 /* handlers called on activate & release virtual terminal */
 void vt_release(int dummy);
@@ -99,31 +241,73 @@ void vt_activate (int dummy);
 /* common handler for several signals (SIGTERM, SIGABRT, etc.) */
 void sig_break(int _);
 
+/* batch: loads image and writes it as planar file (option -b) */
+bool batch_image(struct job *job, FILE *f);
+
 int main(int argc, char* argv[]) {
 	bool quit		= false;
 	bool refresh	= true;
 	FILE *f;
 	char* filename;
-	int  i;
+	int  i, opt;
 	char *e;
 	
 	int  pdx, pdy;
 
 	/* Parse command line */
-	if (argc < 4) {
-		puts("Usage: fbi16 width height file.rgb");
+	while ((opt = getopt(argc, argv, "b:gm:r:")) != -1)
+		switch (opt) {
+			case 'b':
+				batch_dir = optarg;
+				break;
+			case 'g':
+				session = true;
+				break;
+			case 'm':
+				i = strtol(optarg, &e, 10);
+				if (*e != 0 || i <= 0) {
+					puts("Invalid memory limit");
+					return 1;
+				}
+				arena_budget = (size_t)i * 1024 * 1024;
+				break;
+			case 'r':
+				ntransforms = parse_transforms(optarg, transforms);
+				if (ntransforms < 0) {
+					puts("Invalid rotation");
+					return 1;
+				}
+				break;
+			default:
+				argc = 0;
+		}
+
+	if (batch_dir && argc - optind > 0)
+		return batch(batch_dir, &argv[optind], argc - optind, ".p16", batch_image);
+	else if (argc - optind == 1 && !batch_dir)
+		filename = argv[optind];	/* PPM, size is read from file */
+	else if (argc - optind < 3 || batch_dir) {
+		puts("Usage: fbi16 [-g] [-m megabytes] [-r list] width height file.rgb\n"
+		     "       fbi16 [-g] [-m megabytes] [-r list] file.ppm|file.p16\n"
+		     "       fbi16 -b dir [-m megabytes] [-r list] file.ppm|dir ...\n"
+		     "  -b dir    convert PPM files to planar files (.p16) in dir\n"
+		     "  -g        stay in graphics mode (faster redraw)\n"
+		     "  -m mb     memory limit for image\n"
+		     "  -r list   rotate and/or mirror image, list of 90, 180,\n"
+		     "            270 (clockwise), h (left-right), v (top-bottom)\n"
+		     "files may be gzip or zstd compressed");
 		return 0;
 	}
 	else {
-		filename = argv[3];
+		filename = argv[optind + 2];
 
-		width = strtol(argv[1], &e, 10);
+		width = strtol(argv[optind], &e, 10);
 		if (*e != 0 || width <= 0) {
 			puts("Invalid width");
 			return 1;
 		}
 
-		height = strtol(argv[2], &e, 10);
+		height = strtol(argv[optind + 1], &e, 10);
 		if (*e != 0 || height <= 0) {
 			puts("Invalid height");
 			return 1;
@@ -134,9 +318,16 @@ int main(int argc, char* argv[]) {
 	init();
 
 	/* Try to load image */ 
-	f = fopen(filename, "rb"); halt_on_error(filename);
-	read_raw(f);
+	f = open_input(filename); halt_on_error(filename);
+	if (argc - optind == 1 && read_header(f) == 16)
+		read_planar(f);
+	else
+		read_raw(f);
 	fclose(f);
+	for (i=0; i < ntransforms; i++)
+		if (!transform_planes(transforms[i]))
+			error("not enough memory for rotation (see -m)");
+	setup_palette();
 
 	/* Set palette */
 	for (i=0; i<16; i++)
@@ -145,18 +336,11 @@ int main(int argc, char* argv[]) {
 	/* ESC [ 2 J -- erase whole screen */
 	printf("\033[2J");
 	fflush(stdout);
+
+	if (session)
+		session_begin();
 	
-	/* center horizontal */
-	if (blocks < 640/8)
-		sdx = (640/8 - blocks)/2;
-	else
-		sdx = 0;
-	
-	/* center verical */
-	if (height < 480)
-		sdy = (480 - height)/2;
-	else
-		sdy = 0;
+	center_image();
 
 	/* Enter into interactive loop */
 	pdx = pdy = dx = dy = 0;
@@ -176,29 +360,29 @@ int main(int argc, char* argv[]) {
 
 			/* scroll left */
 			case 's':
-				if (blocks > 640/8) {
+				if (blocks > scr_blocks) {
 					dx += 1;
-					if (dx > (blocks - 640/8))
-						dx = blocks - 640/8;
+					if (dx > (blocks - scr_blocks))
+						dx = blocks - scr_blocks;
 				}
 				break;
 			case 'S':
-				if (blocks > 640/8) {
+				if (blocks > scr_blocks) {
 					dx += 2;
-					if (dx > (blocks - 640/8))
-						dx = blocks - 640/8;
+					if (dx > (blocks - scr_blocks))
+						dx = blocks - scr_blocks;
 				}
 				break;
 
 			/* scroll right */
 			case 'a':
-				if (blocks > 640/8) {
+				if (blocks > scr_blocks) {
 					dx -= 1;
 					if (dx < 0) dx = 0;
 				}
 				break;
 			case 'A':
-				if (blocks > 640/8) {
+				if (blocks > scr_blocks) {
 					dx -= 2;
 					if (dx < 0) dx = 0;
 				}
@@ -206,29 +390,29 @@ int main(int argc, char* argv[]) {
 
 			/* scroll down */
 			case 'w':
-				if (height > 480) {
+				if (height > scr_height) {
 					dy += 10;
-					if (dy > (height - 480))
-						dy = height - 480;
+					if (dy > (height - scr_height))
+						dy = height - scr_height;
 				}
 				break;
 			case 'W':
-				if (height > 480) {
+				if (height > scr_height) {
 					dy += 20;
-					if (dy > (height - 480))
-						dy = height - 480;
+					if (dy > (height - scr_height))
+						dy = height - scr_height;
 				}
 				break;
 			
 			/* scroll up */
 			case 'z':
-				if (height > 480) {
+				if (height > scr_height) {
 					dy -= 10;
 					if (dy < 0) dy = 0;
 				}
 				break;
 			case 'Z':
-				if (height > 480) {
+				if (height > scr_height) {
 					dy -= 20;
 					if (dy < 0) dy = 0;
 				}
@@ -240,6 +424,24 @@ int main(int argc, char* argv[]) {
 			case 'R':
 				refresh = true;
 				break;
+
+			/* rotate & mirror image */
+			case '.':
+			case '>':
+				refresh = transform_image(TRANSFORM_ROTATE_90);
+				break;
+			case ',':
+			case '<':
+				refresh = transform_image(TRANSFORM_ROTATE_270);
+				break;
+			case 'h':
+			case 'H':
+				refresh = transform_image(TRANSFORM_MIRROR);
+				break;
+			case 'v':
+			case 'V':
+				refresh = transform_image(TRANSFORM_FLIP);
+				break;
 		}
 	}
 
@@ -252,6 +454,11 @@ int main(int argc, char* argv[]) {
 void halt_on_error(char* info) {
 	int olderrno;
 	if (errno != 0) {
+		if (recover) {
+			snprintf(error_msg, sizeof(error_msg), "%s: %s", info, strerror(errno));
+			errno = 0;
+			longjmp(*recover, 1);
+		}
 		olderrno = errno;
 		clean();
 		fprintf(stdout, "%s [%d]: %s\n", info, olderrno, strerror(olderrno));
@@ -260,12 +467,15 @@ void halt_on_error(char* info) {
 }
 
 void error(char* info) {
+	if (recover) {
+		snprintf(error_msg, sizeof(error_msg), "%s", info);
+		longjmp(*recover, 1);
+	}
 	clean();
 	fprintf(stdout, "%s\n", info);
 	exit(EXIT_FAILURE);
 }
 
-int total_colors = 0;
 int8_t get_color(uint8_t r, uint8_t g, uint8_t b) {
 	int i;
 	/* naive linear searching, but we have max 16 colors */
@@ -273,50 +483,166 @@ int8_t get_color(uint8_t r, uint8_t g, uint8_t b) {
 		if (LUT[i][0] == r && LUT[i][1] == g && LUT[i][2] == b)
 			return i;
 
+	if (++total_colors > 16)
+		return -1;
+
 	LUT[i][0] = r;
 	LUT[i][1] = g;
 	LUT[i][2] = b;
-	return ++total_colors;
+	return i;
+}
+
+int read_header(FILE *f) {
+	int format, maxval;
+	int c;
+
+	/* planar file: "P16 width height colors" */
+	c = fscanf(f, "P%d %d %d %d", &format, &width, &height, &maxval);
+	if (c < 4 || (format != 6 && format != 16))
+		error("Not a PPM file");
+	if (width <= 0 || height <= 0)
+		error("Invalid PPM size");
+	if (format == 6 && maxval != 255)
+		error("Only 8-bit PPMs are supported");
+	if (format == 16 && (maxval < 1 || maxval > 16))
+		error("Invalid number of colors");
+	fgetc(f);	/* single whitespace after maxval */
+
+	if (format == 16)
+		total_colors = maxval;
+	return format;
+}
+
+void read_planar(FILE *f) {
+	size_t n;
+
+	blocks = (width+7)/8;
+	if (fread(LUT, 3, total_colors, f) < (size_t)total_colors)
+		error("Truncated planar file");
+
+	if (!alloc_planes(width, height))
+		error("not enough memory for image (see -m)");
+
+	n = (size_t)blocks * height;
+	if (fread(plane0, 1, n, f) < n || fread(plane1, 1, n, f) < n ||
+	    fread(plane2, 1, n, f) < n || fread(plane3, 1, n, f) < n)
+		error("Truncated planar file");
+}
+
+bool write_planar(FILE *f) {
+	size_t n;
+	bool   ok;
+
+	n = (size_t)blocks * height;
+	fprintf(f, "P16\n%d %d\n%d\n", width, height, total_colors);
+	fwrite(LUT, 3, total_colors, f);
+	fwrite(plane0, 1, n, f);
+	fwrite(plane1, 1, n, f);
+	fwrite(plane2, 1, n, f);
+	fwrite(plane3, 1, n, f);
+
+	ok = !ferror(f);
+	if (!ok) {
+		snprintf(error_msg, sizeof(error_msg), "write failed: %s", strerror(errno));
+		errno = 0;
+	}
+	return ok;
+}
+
+bool load_image(char *filename) {
+	jmp_buf env;
+	FILE    *f;
+	int     i;
+
+	f = open_input(filename);
+	if (f == NULL) {
+		snprintf(error_msg, sizeof(error_msg), "%s: %s", filename, strerror(errno));
+		errno = 0;
+		return false;
+	}
+
+	recover = &env;
+	if (setjmp(env)) {
+		recover = NULL;
+		arena_free(plane0);
+		plane0 = NULL;
+		fclose(f);
+		return false;
+	}
+	if (read_header(f) == 16)
+		read_planar(f);
+	else
+		read_raw(f);
+	for (i=0; i < ntransforms; i++)
+		if (!transform_planes(transforms[i]))
+			error("not enough memory for rotation (see -m)");
+	recover = NULL;
+	fclose(f);
+	return true;
+}
+
+bool batch_image(struct job *job, FILE *f) {
+	bool ok;
+
+	if (!load_image(job->path))
+		return false;
+
+	ok = write_planar(f);
+	if (ok) {
+		job->pixels = (double)width * height;
+		snprintf(job->info, sizeof(job->info), "%dx%d, %d colors",
+		         width, height, total_colors);
+	}
+	arena_free(plane0);
+	plane0 = NULL;
+	return ok;
 }
 
 void read_raw(FILE *f) {
+	struct reader reader;
 	uint8_t* line;
+	uint8_t* data;
 	uint8_t r,g,b, col, bit;
 	int y, x;
 
 	blocks	= (width+7)/8;
-	line = (uint8_t*)malloc(3*8*blocks);
-	if (line == NULL)
-		error("malloc failed (1)");
-	else
-		memset(line, 0, 8*blocks);
-
-	plane0 = (uint8_t*)malloc(blocks * height); if (plane0 == NULL) error("malloc failed (plane0)");
-	plane1 = (uint8_t*)malloc(blocks * height); if (plane1 == NULL) error("malloc failed (plane1)");
-	plane2 = (uint8_t*)malloc(blocks * height); if (plane2 == NULL) error("malloc failed (plane2)");
-	plane3 = (uint8_t*)malloc(blocks * height); if (plane3 == NULL) error("malloc failed (plane3)");
-	memset(plane0, 0, blocks * height);
-	memset(plane1, 0, blocks * height);
-	memset(plane2, 0, blocks * height);
-	memset(plane3, 0, blocks * height);
+	total_colors = 0;
+	if (!alloc_planes(width, height))	/* zeroed */
+		error("not enough memory for image (see -m)");
 	
-	/* read file line by line */
+	/* read file line by line (reader thread reads ahead) */
+	if (!reader_open(&reader, f, -1, 0, (off_t)3 * width * height))
+		error("reader failed");
+
+	/* row crossing chunks is copied here; allocated last, so error()
+	   above doesn't leak it */
+	line = (uint8_t*)calloc(3*8, blocks);
+	if (line == NULL) {
+		reader_close(&reader);
+		error("malloc failed (1)");
+	}
 
 	for (y=0; y < height; y++) {
-		if (fread((void*)line, width, 3, f) < 3) 
+		data = reader_next(&reader, 3*width, line);
+		if (data == NULL) {
+			reader_close(&reader);
+			free(line);
 			error("Truncated file (are width & height correct?)");
-		halt_on_error("fread");
+		}
 		
 		for (x=0; x < width; x++) {
 			/* read R, G, B components */
-			r = line[x*3 + 0];
-			g = line[x*3 + 1];
-			b = line[x*3 + 2];
+			r = data[x*3 + 0];
+			g = data[x*3 + 1];
+			b = data[x*3 + 2];
 
 			/* allocate color index */
 			col = get_color(r,g,b);
-			if (total_colors > 16)
+			if (total_colors > 16) {
+				reader_close(&reader);
+				free(line);
 				error("This program display images contains at most 16 colors.");
+			}
 
 			/* and split index into separate planes */
 			bit = 7-(x & 0x7);
@@ -326,20 +652,117 @@ void read_raw(FILE *f) {
 			plane3[y*blocks + x/8] |= ((col & 0x08) >> 3) << bit;
 		}
 	}
+	reader_close(&reader);
 	free(line);
 }
 
+void center_image() {
+	/* center horizontal */
+	if (blocks < scr_blocks)
+		sdx = (scr_blocks - blocks)/2;
+	else
+		sdx = 0;
+	
+	/* center verical */
+	if (height < scr_height)
+		sdy = (scr_height - height)/2;
+	else
+		sdy = 0;
+}
+
+bool transform_image(int op) {
+	/* called from key handler -- never exits, the key is just refused */
+	if (!transform_planes(op)) {
+		putchar('\a');
+		fflush(stdout);
+		return false;
+	}
+
+	/* size has changed -- erase screen and center again */
+	center_image();
+	dx = dy = 0;
+	page_dirty[0] = page_dirty[1] = true;
+	if (!session) {
+		printf("\033[2J");
+		fflush(stdout);
+	}
+	return true;
+}
+
+bool transform_planes(int op) {
+	uint8_t *planes[4] = {plane0, plane1, plane2, plane3};
+	int i, t;
+
+	if (op != TRANSFORM_ROTATE_90 && op != TRANSFORM_ROTATE_270) {
+		for (i=0; i < 4; i++)
+			if (!transform_bitmap(NULL, planes[i], width, height, op)) {
+				/* mirrors are their own inverse -- undo done planes */
+				while (i--)
+					transform_bitmap(NULL, planes[i], width, height, op);
+				return false;
+			}
+		return true;
+	}
+
+	/* size is swapped -- new arena, both must fit into budget (-m) */
+	if (!alloc_planes(height, width))
+		return false;
+
+	if (!transform_bitmap(plane0, planes[0], width, height, op) ||
+	    !transform_bitmap(plane1, planes[1], width, height, op) ||
+	    !transform_bitmap(plane2, planes[2], width, height, op) ||
+	    !transform_bitmap(plane3, planes[3], width, height, op)) {
+		/* keep the old image */
+		arena_free(plane0);
+		plane0 = planes[0];
+		plane1 = planes[1];
+		plane2 = planes[2];
+		plane3 = planes[3];
+		return false;
+	}
+	arena_free(planes[0]);
+
+	t      = width;
+	width  = height;
+	height = t;
+	blocks = (width + 7)/8;
+	return true;
+}
+
+bool alloc_planes(int width, int height) {
+	uint8_t *p;
+	size_t  plane;
+
+	/* planes at aligned offsets */
+	plane = arena_round((size_t)((width + 7)/8) * height);
+	p     = (uint8_t*)arena_alloc(4 * plane);
+	if (p == NULL)
+		return false;
+
+	plane0 = p;
+	plane1 = plane0 + 1*plane;
+	plane2 = plane0 + 2*plane;
+	plane3 = plane0 + 3*plane;
+	return true;
+}
+
 int fb_fd, tty_fd;
 struct termios term;
 
+/* builds pixel value from 8-bit RGB components (true/direct color modes) */
+uint32_t make_pixel(struct fb_var_screeninfo *v, uint8_t r, uint8_t g, uint8_t b) {
+	return ((uint32_t)(r >> (8 - v->red.length))   << v->red.offset)   |
+	       ((uint32_t)(g >> (8 - v->green.length)) << v->green.offset) |
+	       ((uint32_t)(b >> (8 - v->blue.length))  << v->blue.offset);
+}
+
 void init() {
 	int old_clflag;
-	struct fb_fix_screeninfo fixscreeninfo;
-	struct fb_fix_screeninfo varscreeninfo;
-	
 	struct sigaction sa;
 	struct vt_mode s;
 
+	memset(&sa, 0, sizeof(sa));
+
 	/* open terminal */
 	tty_fd	= open("/dev/tty", O_RDWR); halt_on_error("/dev/tty");
 	
@@ -350,14 +773,6 @@ void init() {
 	tcsetattr(tty_fd, TCSAFLUSH, &term); halt_on_error("tcsetattr");
 	term.c_lflag	 = old_clflag;
 
-	/* obtain permissions to modify */ 
-	/* 1. graphics controler */
-	ioperm(CTRL_IDX,  1, 1);	ordie("ioperm (1)");
-	ioperm(CTRL_DATA, 1, 1);	ordie("ioperm (2)");
-	/* 2. sequencer */
-	ioperm(SEQ_IDX,   1, 1);	ordie("ioperm (3)");
-	ioperm(SEQ_DATA,  1, 1);	ordie("ioperm (4)");
-	
 	/* set signal handlers */
 	signal(SIGINT,  sig_break); ordie("SIGINT");
 	signal(SIGTERM, sig_break); ordie("SIGTERM");
@@ -369,15 +784,54 @@ void init() {
 	
 	/* get some info about framebuffer */
 	ioctl(fb_fd, FBIOGET_VSCREENINFO, &varscreeninfo); ordie("varscreeninfo");
-	if (varscreeninfo.type != FB_TYPE_VGA_PLANES)
-		error("This program supports just vga16fb framebuffer");
 	ioctl(fb_fd, FBIOGET_FSCREENINFO, &fixscreeninfo); ordie("fixscreeninfo");
+	switch (fixscreeninfo.type) {
+		case FB_TYPE_VGA_PLANES:
+			packed = false;
+			break;
+		case FB_TYPE_PACKED_PIXELS:
+			packed = true;
+			break;
+		default:
+			error("This program supports vga16fb and packed pixels framebuffers");
+	}
+
+	scr_width	= varscreeninfo.xres;
+	scr_height	= varscreeninfo.yres;
+	scr_blocks	= scr_width/8;
+	line_length	= fixscreeninfo.line_length;
+
+	if (packed) {
+		if (varscreeninfo.bits_per_pixel != 8  &&
+		    varscreeninfo.bits_per_pixel != 16 &&
+		    varscreeninfo.bits_per_pixel != 32)
+			error("Only 8, 16 and 32 bpp packed pixels are supported");
+		bytespp = varscreeninfo.bits_per_pixel/8;
+		if (line_length == 0)
+			line_length = varscreeninfo.xres_virtual * bytespp;
+	}
+	else {
+		if (line_length == 0)
+			line_length = scr_blocks;
+
+		/* obtain permissions to modify */ 
+		/* 1. graphics controler */
+		ioperm(CTRL_IDX,  1, 1);	ordie("ioperm (1)");
+		ioperm(CTRL_DATA, 1, 1);	ordie("ioperm (2)");
+		/* 2. sequencer */
+		ioperm(SEQ_IDX,   1, 1);	ordie("ioperm (3)");
+		ioperm(SEQ_DATA,  1, 1);	ordie("ioperm (4)");
+	}
+
+	setup_pages();
 
 	/* map video memory to our memory segment */
 	screen_size = fixscreeninfo.smem_len;
 	screen = mmap((void*)fixscreeninfo.smem_start, screen_size,
                   PROT_READ|PROT_WRITE, MAP_SHARED, fb_fd, 0);
 
+	vsync_init();
+
 
 	/* take over virtual terminal switching */
 	ioctl(tty_fd, VT_GETMODE, &s); ordie("VT_GETMODE");
@@ -397,11 +851,23 @@ void init() {
 }
 
 void clean() {
-#if SETMODE
+	/* batch didn't touch screen & terminal */
+	if (batch_dir)
+		return;
+
 	/* set console mode (text, rather graphics) */
-	ioctl(tty_fd, KDSETMODE, KD_TEXT);
-#endif
+	if (session)
+		ioctl(tty_fd, KDSETMODE, KD_TEXT);
 	
+	/* show first page again (console draws there) */
+	if (pages == 2) {
+		panvar.yoffset = 0;
+		ioctl(fb_fd, FBIOPAN_DISPLAY, &panvar);
+		if (var_changed)
+			ioctl(fb_fd, FBIOPUT_VSCREENINFO, &oldvar);
+		pages = 1;
+	}
+
 	/* restore terminal mode */
 	tcsetattr(tty_fd, TCSAFLUSH, &term);
 	
@@ -430,12 +896,24 @@ void EGA_mask_planes(int n) {
 	outb(n, SEQ_DATA);
 }
 
+void EGA_map_mask(int n) {
+	/* Map mask (sequencer index 2) -- planes written by CPU */
+	outb(2, SEQ_IDX);
+	outb(n, SEQ_DATA);
+}
+
+void EGA_enable_set_reset(int n) {
+	/* Enable set/reset (index 1) */
+	outb(1, CTRL_IDX);
+	outb(n, CTRL_DATA);
+}
+
 void EGA_set_write_mode(uint8_t mode) {
 	volatile uint8_t p;
 
 	outb(5, CTRL_IDX);
 	p = inb(CTRL_DATA);
-	p = (p & ~0xfc) | (mode & 0x3);	/* modify only 2 lower bits */
+	p = (p & ~0x03) | (mode & 0x3);	/* modify only 2 lower bits */
 	outb(5, CTRL_IDX);
 	outb(p, CTRL_DATA);
 }
@@ -446,19 +924,26 @@ void EGA_set_color(uint8_t color) {
 	outb(color & 0xf, CTRL_DATA);
 }
 
-void show_image(int dx, int dy) {
-	int y, w, h;
-	int screen_offset, plane_offset;
-	
+void EGA_read_plane(int n) {
 	volatile uint8_t p;
 
-	printf("\033[1;1H"); fflush(stdout);
+	/* Mode (index 5), bit 3 -- read mode 0: CPU reads one plane */
+	outb(5, CTRL_IDX);
+	p = inb(CTRL_DATA);
+	outb(5, CTRL_IDX);
+	outb(p & ~0x08, CTRL_DATA);
 
-#ifdef _SETMODE
-	ioctl(tty_fd, KDSETMODE, KD_GRAPHICS);
-#endif
-	EGA_set_write_mode(3);
-	EGA_set_color(0xff);
+	/* Read map select (index 4) */
+	outb(4, CTRL_IDX);
+	outb(n & 0x3, CTRL_DATA);
+}
+
+void EGA_copy_mode() {
+	/* Write mode 0 without set/reset -- CPU data goes directly to planes
+	   enabled by map mask, so each plane is simply copied and the row
+	   never shows intermediate colors */
+	EGA_set_write_mode(0);
+	EGA_enable_set_reset(0x00);
 	
 	/* Data rotate & function select (index 3) */
 	outb(3, CTRL_IDX);
@@ -467,60 +952,509 @@ void show_image(int dx, int dy) {
 	/* Bit mask (index 8) */
 	outb(8, CTRL_IDX);
 	outb(0xff, CTRL_DATA);	/* enable all bits */
+}
 
-	w = width  > 640 ? 640/8 : blocks;
-	h = height > 480 ? 480   : height;
+void EGA_restore_mode() {
+	/* restore state left by vga16fb */
+	EGA_set_write_mode(3);
+	EGA_set_color(0xff);
+	EGA_mask_planes(0x0f);
+}
 
-	screen_offset = sdy * 640/8 + sdx;
-	plane_offset  = dy  * blocks + dx;
-	for (y=0; y<h; y++) {
+void show_image(int dx, int dy) {
+	int y, w, h;
+	int screen_offset, plane_offset;
+	uint8_t *base;
 
-		/* clear current line */
-		EGA_set_color(0x00);
-		EGA_mask_planes(0x0f); /* enable all planes */
-		memset(&screen[screen_offset], 0xff, 640/8);
+	/* VT release (signal) waits until drawing is finished */
+	drawing = 1;
+	if (!vt_active) {
+		drawing = 0;
+		return;
+	}
 
-		
-		EGA_set_color(0xff);
+	if (!session) {
+		printf("\033[1;1H"); fflush(stdout);
+#ifdef _SETMODE
+		ioctl(tty_fd, KDSETMODE, KD_GRAPHICS);
+#endif
+	}
 
-		p = screen[screen_offset];
-		/* copy plane 0 */
-		EGA_mask_planes(0x0f);
-		memcpy(&screen[screen_offset], &plane0[plane_offset], w);
-		
-		/* copy plane 1 */
-		EGA_mask_planes(0x02);
-		memcpy(&screen[screen_offset], &plane1[plane_offset], w);
-		
-		/* copy plane 2 */
-		EGA_mask_planes(0x04);
-		memcpy(&screen[screen_offset], &plane2[plane_offset], w);
-		
-		/* copy plane 3 */
-		EGA_mask_planes(0x08);
-		memcpy(&screen[screen_offset], &plane3[plane_offset], w);
-		
+	w = blocks > scr_blocks ? scr_blocks : blocks;
+	h = height > scr_height ? scr_height : height;
+
+	if (packed) {
+		/* draw on hidden page if there is one, otherwise chase the beam */
+		base = screen;
+		if (pages == 2) {
+			base = &screen[(1 - page) * page_size];
+			if (page_dirty[1 - page]) {
+				clear_page(base);
+				page_dirty[1 - page] = false;
+			}
+		}
+		else if (page_dirty[0]) {
+			clear_page(base);
+			page_dirty[0] = false;
+		}
 
-		/* next line */
-		screen_offset += 640/8;
-		plane_offset  += blocks;
+		screen_offset = sdy * line_length + sdx * 8 * bytespp;
+		plane_offset  = dy  * blocks + dx;
+		if (pages == 1) frame_begin();
+		for (y=0; y<h; y++) {
+			if (pages == 1) frame_row(sdy + y);
+			expand_row(&base[screen_offset], plane_offset, w);
+
+			screen_offset += line_length;
+			plane_offset  += blocks;
+		}
+
+		if (pages == 2) {
+			page = 1 - page;
+			flip_page();
+		}
 	}
+	else {
+		EGA_copy_mode();
+		if (page_dirty[0]) {
+			/* image size has changed -- erase all planes */
+			EGA_map_mask(0x0f);
+			memset(screen, 0, scr_height * line_length);
+			page_dirty[0] = false;
+		}
 
-	EGA_mask_planes(0x0f);
-	
+		screen_offset = sdy * line_length + sdx;
+		plane_offset  = dy  * blocks + dx;
+		frame_begin();
+		for (y=0; y<h; y++) {
+			frame_row(sdy + y);
+
+			EGA_map_mask(0x01);
+			memcpy(&screen[screen_offset], &plane0[plane_offset], w);
+			EGA_map_mask(0x02);
+			memcpy(&screen[screen_offset], &plane1[plane_offset], w);
+			EGA_map_mask(0x04);
+			memcpy(&screen[screen_offset], &plane2[plane_offset], w);
+			EGA_map_mask(0x08);
+			memcpy(&screen[screen_offset], &plane3[plane_offset], w);
+
+			/* next line */
+			screen_offset += line_length;
+			plane_offset  += blocks;
+		}
+
+		EGA_restore_mode();
+	}
 
 #ifdef _SETMODE
-	ioctl(tty_fd, KDSETMODE, KD_TEXT);
+	if (!session)
+		ioctl(tty_fd, KDSETMODE, KD_TEXT);
+#endif
+
+	drawing = 0;
+	if (release_pending) {
+		release_pending = 0;
+		release_vt();
+	}
+}
+
+void clear_page(uint8_t *base) {
+	int y;
+
+	/* console background is black -- zero in all packed modes */
+	for (y=0; y < scr_height; y++)
+		memset(&base[y * line_length], 0, scr_width * bytespp);
+}
+
+void flip_page() {
+	/* change display start during blanking, so the new page
+	   appears at once; some drivers latch the offset, some don't */
+	wait_vsync();
+	panvar.xoffset = 0;
+	panvar.yoffset = page * scr_height;
+	if (ioctl(fb_fd, FBIOPAN_DISPLAY, &panvar) < 0) {
+		/* should not happen (checked in setup_pages) */
+		errno = 0;
+		pages = 1;
+		page  = 0;
+	}
+}
+
+void setup_pages() {
+	pages = 1;
+	page  = 0;
+
+	/* vga16fb has only 64kB window -- not enough for two 640x480 pages */
+	if (!packed || fixscreeninfo.ypanstep == 0)
+		return;
+
+	oldvar = varscreeninfo;
+	if (varscreeninfo.yres_virtual < 2*varscreeninfo.yres) {
+		/* unsigned 64-bit: line_length is int and the product may overflow */
+		if (fixscreeninfo.smem_len <
+		    2 * (uint64_t)varscreeninfo.yres * (unsigned)line_length)
+			return;
+
+		/* ask driver for taller virtual screen */
+		varscreeninfo.yres_virtual = 2*varscreeninfo.yres;
+		if (ioctl(fb_fd, FBIOPUT_VSCREENINFO, &varscreeninfo) < 0 ||
+		    ioctl(fb_fd, FBIOGET_VSCREENINFO, &varscreeninfo) < 0 ||
+		    ioctl(fb_fd, FBIOGET_FSCREENINFO, &fixscreeninfo) < 0 ||
+		    varscreeninfo.yres_virtual < 2*varscreeninfo.yres) {
+			errno = 0;
+			ioctl(fb_fd, FBIOPUT_VSCREENINFO, &oldvar);
+			errno = 0;
+			varscreeninfo = oldvar;
+			return;
+		}
+		var_changed = true;
+		if (fixscreeninfo.line_length)
+			line_length = fixscreeninfo.line_length;
+	}
+
+	page_size = line_length * scr_height;
+	if (fixscreeninfo.smem_len < 2 * (uint64_t)(unsigned)page_size)
+		return;
+
+	/* check if panning works */
+	panvar = varscreeninfo;
+	panvar.xoffset = 0;
+	panvar.yoffset = 0;
+	if (ioctl(fb_fd, FBIOPAN_DISPLAY, &panvar) < 0) {
+		errno = 0;
+		return;
+	}
+
+	pages = 2;
+	page_dirty[0] = page_dirty[1] = true;
+}
+
+
+/* Packed pixels.  Four bits (one from each plane) form color index, which
+   is then translated through palette.  SSE2 code builds 16 indices at
+   once, SSSE3 code also does palette lookup with pshufb -- each byte of
+   pixel values has its own 16-entry table. */
+
+uint8_t palette_bytes[4][16];	/* k-th byte of palette entries */
+
+static inline int pixel_index(int ofs, int bit) {
+	uint8_t m = 0x80 >> bit;
+	return ((plane0[ofs] & m) ? 0x01 : 0) |
+	       ((plane1[ofs] & m) ? 0x02 : 0) |
+	       ((plane2[ofs] & m) ? 0x04 : 0) |
+	       ((plane3[ofs] & m) ? 0x08 : 0);
+}
+
+static inline void put_pixel(uint8_t *dst, int i, uint32_t pixel) {
+	switch (bytespp) {
+		case 1: dst[i] = pixel; break;
+		case 2: ((uint16_t*)dst)[i] = pixel; break;
+		case 4: ((uint32_t*)dst)[i] = pixel; break;
+	}
+}
+
+void expand_row_scalar(uint8_t *dst, int ofs, int n) {
+	int i, bit;
+
+	for (i=0; i < n; i++)
+		for (bit=0; bit < 8; bit++)
+			put_pixel(dst, i*8 + bit, palette[pixel_index(ofs + i, bit)]);
+}
+
+#ifdef __SSE2__
+/* 2 blocks of planes -> 16 color indices */
+static inline __m128i planes_to_indices(int ofs) {
+	const __m128i sel = _mm_setr_epi8(
+		(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+		(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	__m128i idx, v;
+
+#define PLANE_BITS(plane, weight) \
+	v = _mm_unpacklo_epi64(_mm_set1_epi8(plane[ofs]), _mm_set1_epi8(plane[ofs+1])); \
+	v = _mm_cmpeq_epi8(_mm_and_si128(v, sel), sel); \
+	idx = _mm_or_si128(idx, _mm_and_si128(v, _mm_set1_epi8(weight)));
+
+	idx = _mm_setzero_si128();
+	PLANE_BITS(plane0, 0x01)
+	PLANE_BITS(plane1, 0x02)
+	PLANE_BITS(plane2, 0x04)
+	PLANE_BITS(plane3, 0x08)
+#undef PLANE_BITS
+
+	return idx;
+}
+
+void expand_row_sse2(uint8_t *dst, int ofs, int n) {
+	uint8_t idx[16];
+	int i, k;
+
+	for (i=0; i+1 < n; i += 2) {
+		_mm_storeu_si128((__m128i*)idx, planes_to_indices(ofs + i));
+		for (k=0; k < 16; k++)
+			put_pixel(dst, i*8 + k, palette[idx[k]]);
+	}
+	if (i < n)
+		expand_row_scalar(dst + i*8*bytespp, ofs + i, n - i);
+}
+
+__attribute__((target("ssse3")))
+void expand_row_ssse3(uint8_t *dst, int ofs, int n) {
+	const __m128i t0 = _mm_loadu_si128((__m128i*)palette_bytes[0]);
+	const __m128i t1 = _mm_loadu_si128((__m128i*)palette_bytes[1]);
+	const __m128i t2 = _mm_loadu_si128((__m128i*)palette_bytes[2]);
+	const __m128i t3 = _mm_loadu_si128((__m128i*)palette_bytes[3]);
+	__m128i idx, b0, b1, b2, b3, lo, hi;
+	__m128i *out;
+	int i;
+
+	for (i=0; i+1 < n; i += 2) {
+		idx = planes_to_indices(ofs + i);
+		out = (__m128i*)(dst + i*8*bytespp);
+		b0  = _mm_shuffle_epi8(t0, idx);
+		switch (bytespp) {
+			case 1:
+				_mm_storeu_si128(out, b0);
+				break;
+			case 2:
+				b1 = _mm_shuffle_epi8(t1, idx);
+				_mm_storeu_si128(out + 0, _mm_unpacklo_epi8(b0, b1));
+				_mm_storeu_si128(out + 1, _mm_unpackhi_epi8(b0, b1));
+				break;
+			case 4:
+				b1 = _mm_shuffle_epi8(t1, idx);
+				b2 = _mm_shuffle_epi8(t2, idx);
+				b3 = _mm_shuffle_epi8(t3, idx);
+				lo = _mm_unpacklo_epi8(b0, b1);
+				hi = _mm_unpacklo_epi8(b2, b3);
+				_mm_storeu_si128(out + 0, _mm_unpacklo_epi16(lo, hi));
+				_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo, hi));
+				lo = _mm_unpackhi_epi8(b0, b1);
+				hi = _mm_unpackhi_epi8(b2, b3);
+				_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(lo, hi));
+				_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(lo, hi));
+				break;
+		}
+	}
+	if (i < n)
+		expand_row_scalar(dst + i*8*bytespp, ofs + i, n - i);
+}
+#endif
+
+void setup_palette() {
+	int i, k;
+
+	for (i=0; i<16; i++) {
+		/* palette modes use console colors, set with ESC ] P */
+		if (fixscreeninfo.visual == FB_VISUAL_TRUECOLOR ||
+		    fixscreeninfo.visual == FB_VISUAL_DIRECTCOLOR)
+			palette[i] = make_pixel(&varscreeninfo, LUT[i][0], LUT[i][1], LUT[i][2]);
+		else
+			palette[i] = i;
+
+		for (k=0; k<4; k++)
+			palette_bytes[k][i] = palette[i] >> (8*k);
+	}
+
+#ifdef __SSE2__
+	if (__builtin_cpu_supports("ssse3"))
+		expand_row = expand_row_ssse3;
+	else
+		expand_row = expand_row_sse2;
+#else
+	expand_row = expand_row_scalar;
 #endif
 }
 
 
+/* Vertical retrace.  Updates start just after retrace and go down the
+   screen ahead of the beam; when the beam catches up, the rest of rows
+   waits for the next retrace.  So no row is ever changed while it is
+   displayed, and large updates are spread across several frames. */
+
+void vsync_init() {
+	__u32  crtc = 0;
+	double t;
+	int    i;
+
+	/* the driver can wait for us... */
+	if (ioctl(fb_fd, FBIO_WAITFORVSYNC, &crtc) == 0)
+		vsync_method = VSYNC_IOCTL;
+	/* ...or we poll VGA input status register */
+	else if (!packed && ioperm(INPUT_STATUS_1, 1, 1) == 0)
+		vsync_method = VSYNC_PORT;
+	else
+		vsync_method = VSYNC_NONE;
+	errno = 0;
+
+	if (vsync_method == VSYNC_NONE)
+		return;
+
+	/* scanlines per frame (with blanking) */
+	total_lines = varscreeninfo.yres + varscreeninfo.upper_margin +
+	              varscreeninfo.lower_margin + varscreeninfo.vsync_len;
+	first_line  = varscreeninfo.upper_margin + varscreeninfo.vsync_len;
+	if (total_lines <= (int)varscreeninfo.yres) {
+		/* timings unknown, assume VGA-like */
+		total_lines = varscreeninfo.yres * 525 / 480;
+		first_line  = varscreeninfo.yres * 35 / 480;
+	}
+
+	/* measure refresh period */
+	wait_vsync();
+	t = vsync_time;
+	for (i=0; i < 4; i++)
+		wait_vsync();
+	frame_ms = (vsync_time - t) / 4;
+
+	if (frame_ms < 5.0 || frame_ms > 100.0) /* retrace doesn't work */
+		vsync_method = VSYNC_NONE;
+}
+
+void wait_vsync() {
+	__u32  crtc = 0;
+	double t;
+
+	switch (vsync_method) {
+		case VSYNC_IOCTL:
+			ioctl(fb_fd, FBIO_WAITFORVSYNC, &crtc);
+			break;
+
+		case VSYNC_PORT:
+			/* wait for end of current retrace, then for the next one
+			   (at most 100ms -- just in case) */
+			t = now_ms();
+			while ((inb(INPUT_STATUS_1) & 0x08) && now_ms() - t < 100.0)
+				;
+			while (!(inb(INPUT_STATUS_1) & 0x08) && now_ms() - t < 100.0)
+				;
+			break;
+
+		default:
+			return;
+	}
+
+	vsync_time = now_ms();
+}
+
+int beam_line() {
+	double lines;
+
+	lines = (now_ms() - vsync_time) / frame_ms * total_lines;
+	return (int)lines % total_lines - first_line;
+}
+
+void frame_begin() {
+	wait_vsync();
+}
+
+void frame_row(int row) {
+	if (vsync_method != VSYNC_NONE && beam_line() >= row - 1)
+		wait_vsync();
+}
+
+
+void session_begin() {
+	/* console must not draw (cursor, messages) over image */
+	ioctl(tty_fd, KDSETMODE, KD_GRAPHICS); ordie("KD_GRAPHICS");
+
+	/* VGA -- four planes, packed -- displayed page */
+	shadow = (uint8_t*)malloc((packed ? 1 : 4) * scr_height * line_length);
+	if (shadow == NULL) error("malloc failed (shadow)");
+
+	set_cmap();
+}
+
+void set_cmap() {
+	uint16_t r[16], g[16], b[16];
+	struct fb_cmap cmap;
+	int i;
+
+	/* console doesn't restore palette of VT in graphics mode */
+	if (fixscreeninfo.visual != FB_VISUAL_PSEUDOCOLOR)
+		return;
+
+	for (i=0; i<16; i++) {
+		r[i] = LUT[i][0] * 0x101;
+		g[i] = LUT[i][1] * 0x101;
+		b[i] = LUT[i][2] * 0x101;
+	}
+
+	cmap.start  = 0;
+	cmap.len    = 16;
+	cmap.red    = r;
+	cmap.green  = g;
+	cmap.blue   = b;
+	cmap.transp = NULL;
+	ioctl(fb_fd, FBIOPUTCMAP, &cmap);
+	errno = 0;
+}
+
+void restore_screen() {
+	int n = scr_height * line_length;
+
+	if (packed) {
+		/* console could pan the other page in */
+		if (pages == 2) {
+			panvar.xoffset = 0;
+			panvar.yoffset = page * scr_height;
+			ioctl(fb_fd, FBIOPAN_DISPLAY, &panvar);
+			page_dirty[1 - page] = true;
+		}
+		memcpy(&screen[page * page_size], shadow, n);
+		return;
+	}
+
+	EGA_copy_mode();
+	EGA_map_mask(0x01);
+	memcpy(screen, &shadow[0*n], n);
+	EGA_map_mask(0x02);
+	memcpy(screen, &shadow[1*n], n);
+	EGA_map_mask(0x04);
+	memcpy(screen, &shadow[2*n], n);
+	EGA_map_mask(0x08);
+	memcpy(screen, &shadow[3*n], n);
+	EGA_restore_mode();
+}
+
 void vt_activate(int dummy) {
 	ioctl(tty_fd, VT_RELDISP, VT_ACKACQ);
+	if (!session)
+		return;
+
+	/* one bulk copy instead of rendering image again */
+	set_cmap();
+	restore_screen();
+	vt_active = 1;
 }
 
 void vt_release(int dummy) {
-	ioctl(tty_fd, VT_RELDISP, 0); /* do not allow console switching */
+	if (!session) {
+		ioctl(tty_fd, VT_RELDISP, 0); /* do not allow console switching */
+		return;
+	}
+
+	if (drawing)
+		release_pending = 1;
+	else
+		release_vt();
+}
+
+void release_vt() {
+	int n = scr_height * line_length;
+	int i;
+
+	if (packed)
+		memcpy(shadow, &screen[page * page_size], n);
+	else {
+		for (i=0; i<4; i++) {
+			EGA_read_plane(i);
+			memcpy(&shadow[i*n], screen, n);
+		}
+		EGA_read_plane(0);
+	}
+
+	vt_active = 0;
+	ioctl(tty_fd, VT_RELDISP, 1);
 }
 
 void sig_break(int _) {
@@ -2,6 +2,13 @@
 
 if [ -e $1 ]
 then
+	case $1 in
+		*.ppm.gz|*.ppm.zst)
+			# compressed files are read directly, others (plain too) are
+			# quantized and cached below
+			exec fbi16_2.bin $1
+			;;
+	esac
 	f=/tmp/`basename $1`.rgb
 	if [ $1 -nt $f ]
 	then
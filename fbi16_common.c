@@ -0,0 +1,1450 @@
+/*
+	Code shared by fbi16 and fbi16_2 (see fbi16_common.h)
+
+	Wojciech Mua
+	wojciech_mula@poczta.onet.pl
+	license BSD
+*/
+
+#define _GNU_SOURCE		/* fopencookie */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "fbi16_common.h"
+
+#include <errno.h>
+extern int errno;
+
+__thread jmp_buf *recover;
+__thread char     error_msg[256];
+
+/* image storage (see arena_alloc) */
+size_t arena_used;
+size_t arena_peak;
+size_t arena_budget;
+pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+void (*arena_reclaim)(size_t size);
+
+pthread_cond_t  arena_freed = PTHREAD_COND_INITIALIZER;
+unsigned        arena_frees;		/* incremented by arena_free */
+size_t          arena_held;			/* bytes of threads waiting for budget */
+__thread size_t arena_mine;			/* bytes mapped by this thread */
+__thread bool   arena_blocked;		/* failed only because of other threads */
+
+/* batch conversion */
+struct worker {
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	int  *queue;			/* job indices, owner takes from head,
+	                           thieves from tail */
+	int   head, tail;
+	int   id;
+	int   steals;
+};
+
+char          *batch_dir;
+char          *batch_ext;		/* extension of output files */
+batch_convert  batch_fn;
+mode_t         batch_mode;		/* of output files (0666 & ~umask) */
+struct job    *jobs;
+int            njobs;
+int            batch_errors;	/* files which couldn't be listed */
+struct worker *workers;
+int            nworkers;
+int            batch_busy;		/* workers converting at the moment */
+dev_t          batch_dev;		/* output directory is skipped when */
+ino_t          batch_ino;		/* input directories are searched */
+
+/* adds file or files of directory (recursively) to jobs; name -- path
+   of output file relative to output directory (without extension) */
+void batch_add(char *path, char *name);
+
+/* fails jobs whose output files would overwrite each other */
+void batch_clashes();
+
+/* name of argument in output directory: its last component, nothing for
+   ".", ".." and "/" */
+char *batch_name(char *path);
+
+/* output file: dir/name without extensions (.gz, .zst, .pgm) + ext */
+char *batch_output(char *name, char *ext);
+
+/* creates directories on the way from batch_dir to out; false on error
+   (message is in error_msg) */
+bool batch_mkdirs(char *out);
+
+/* takes job from worker's queue or steals one; -1 if none left */
+int batch_take(struct worker *w);
+void *batch_worker(void *arg);
+
+/* waits until length fits into hard budget (arena_lock held); false if
+   it never will */
+bool arena_wait(size_t length);
+
+/* input & storage *************************************************/
+
+double now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Image storage.  Every image gets one arena -- anonymous mapping, so the
+   kernel hands out zeroed pages and nothing has to be cleared.  Arenas of
+   2 MiB and more start at 2 MiB boundary and are advised as transparent
+   huge pages, so blit and packing loops go through fewer TLB entries.
+   Mapped bytes are counted against memory budget. */
+
+void *arena_alloc(size_t size) {
+	uint8_t *base, *p;
+	size_t  page, length, extra;
+
+	page   = sysconf(_SC_PAGESIZE);
+	length = (size + ARENA_HEADER + page - 1) & ~(page - 1);
+	extra  = length >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 0;
+
+	/* budget is taken before mapping (batch workers allocate in parallel) */
+	pthread_mutex_lock(&arena_lock);
+	if (arena_budget && arena_used + length > arena_budget) {
+		if (arena_reclaim) {
+			pthread_mutex_unlock(&arena_lock);
+			arena_reclaim(length);	/* displayed image stays, so budget
+			                           can be exceeded by it */
+			pthread_mutex_lock(&arena_lock);
+		}
+		else if (!arena_wait(length)) {
+			pthread_mutex_unlock(&arena_lock);
+			return NULL;		/* hard limit (-m) */
+		}
+	}
+	arena_used += length;
+	arena_mine += length;
+	if (arena_used > arena_peak)
+		arena_peak = arena_used;
+	pthread_mutex_unlock(&arena_lock);
+
+	base = (uint8_t*)mmap(NULL, length + extra, PROT_READ | PROT_WRITE,
+	                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		pthread_mutex_lock(&arena_lock);
+		arena_used -= length;
+		arena_mine -= length;
+		pthread_cond_broadcast(&arena_freed);
+		pthread_mutex_unlock(&arena_lock);
+		return NULL;
+	}
+
+	if (extra) {
+		/* cut the mapping to 2 MiB boundary */
+		p = (uint8_t*)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+		if (p > base)
+			munmap(base, p - base);
+		if (p + length < base + length + extra)
+			munmap(p + length, base + extra - p);
+		base = p;
+#ifdef MADV_HUGEPAGE
+		madvise(base, length, MADV_HUGEPAGE);
+#endif
+	}
+
+	*(size_t*)base = length;
+	return base + ARENA_HEADER;
+}
+
+void arena_free(void *p) {
+	uint8_t *base;
+
+	if (p == NULL)
+		return;
+
+	base = (uint8_t*)p - ARENA_HEADER;
+	pthread_mutex_lock(&arena_lock);
+	arena_used -= *(size_t*)base;
+	arena_mine -= *(size_t*)base;
+	arena_frees++;
+	pthread_cond_broadcast(&arena_freed);
+	pthread_mutex_unlock(&arena_lock);
+	munmap(base, *(size_t*)base);
+}
+
+/* Hard budget is shared by batch workers: image which doesn't fit waits
+   until other workers finish theirs.  Waiting makes sense only while some
+   thread that isn't waiting holds memory -- it will free it (or wait and
+   find out it can't go on).  If all other holders wait, the thread fails
+   and batch converts its image again (arena_retry), once memory is freed.
+   Image which can't fit even alone fails. */
+
+bool arena_wait(size_t length) {
+	while (arena_used + length > arena_budget) {
+		if (arena_mine + length > arena_budget)
+			return false;
+		if (arena_used - arena_mine - arena_held == 0) {
+			arena_blocked = true;	/* the others wait for us */
+			return false;
+		}
+
+		arena_held += arena_mine;
+		pthread_cond_wait(&arena_freed, &arena_lock);
+		arena_held -= arena_mine;
+	}
+	return true;
+}
+
+bool arena_retry() {
+	unsigned frees;
+
+	if (!arena_blocked)
+		return false;
+	arena_blocked = false;
+
+	/* our memory is freed already -- wait until the others free some */
+	pthread_mutex_lock(&arena_lock);
+	frees = arena_frees;
+	while (arena_frees == frees && arena_used > 0)
+		pthread_cond_wait(&arena_freed, &arena_lock);
+	pthread_mutex_unlock(&arena_lock);
+	return true;
+}
+
+/* Asynchronous reader.  Thread reads file into ring of large chunks while
+   caller converts data from previous ones, so disk latency and conversion
+   overlap. */
+
+void *reader_thread(void *arg) {
+	struct reader *r = (struct reader*)arg;
+	size_t  n;
+	ssize_t k;
+	int     i;
+
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; ; i = (i + 1) % READER_CHUNKS) {
+		while (r->filled == READER_CHUNKS && !r->stop)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (r->stop || r->remaining == 0)
+			break;
+		pthread_mutex_unlock(&r->lock);
+
+		/* chunk i is free -- fill it */
+		n = r->remaining < READER_CHUNK_SIZE ? r->remaining : READER_CHUNK_SIZE;
+		if (r->fd >= 0) {
+			k = pread(r->fd, r->chunk[i], n, r->offset);
+			if (k > 0)
+				r->offset += k;
+		}
+		else
+			k = fread(r->chunk[i], 1, n, r->f);
+
+		pthread_mutex_lock(&r->lock);
+		if (k <= 0)
+			break;
+		r->length[i]  = k;
+		r->remaining -= k;
+		r->filled++;
+		pthread_cond_broadcast(&r->cond);
+	}
+	r->done = true;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+bool reader_open(struct reader *r, FILE *f, int fd, off_t offset, off_t length) {
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	r->f         = f;
+	r->fd        = fd;
+	r->offset    = offset;
+	r->remaining = length;
+
+	for (i=0; i < READER_CHUNKS; i++)
+		if (posix_memalign((void**)&r->chunk[i], 4096, READER_CHUNK_SIZE) != 0) {
+			while (i--)
+				free(r->chunk[i]);
+			return false;
+		}
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if (pthread_create(&r->thread, NULL, reader_thread, r) != 0) {
+		for (i=0; i < READER_CHUNKS; i++)
+			free(r->chunk[i]);
+		return false;
+	}
+
+	return true;
+}
+
+uint8_t *reader_next(struct reader *r, size_t n, uint8_t *buf) {
+	uint8_t *data = NULL;
+	size_t   k, copied = 0;
+
+	pthread_mutex_lock(&r->lock);
+	while (copied < n) {
+		while (r->filled == 0 && !r->done)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (r->filled == 0)
+			break;
+
+		/* chunk consumed -- give it back to reader (it is done here,
+		   as pointer returned by previous call could point to it) */
+		if (r->pos == r->length[r->first]) {
+			r->first = (r->first + 1) % READER_CHUNKS;
+			r->pos   = 0;
+			r->filled--;
+			pthread_cond_broadcast(&r->cond);
+			continue;
+		}
+
+		k = r->length[r->first] - r->pos;
+		if (copied == 0 && k >= n) {
+			/* whole block in a chunk -- no copy */
+			data    = r->chunk[r->first] + r->pos;
+			r->pos += n;
+			copied  = n;
+		}
+		else {
+			if (k > n - copied)
+				k = n - copied;
+			memcpy(buf + copied, r->chunk[r->first] + r->pos, k);
+			r->pos += k;
+			copied += k;
+			data    = buf;
+		}
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return copied == n ? data : NULL;
+}
+
+void reader_close(struct reader *r) {
+	int i;
+
+	pthread_mutex_lock(&r->lock);
+	r->stop = true;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+
+	for (i=0; i < READER_CHUNKS; i++)
+		free(r->chunk[i]);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+}
+
+/* Compressed input.  gzip members and zstd frames are independent, so
+   file is mapped into memory, split into such parts and worker threads
+   decompress several parts at once.  Output of each part is a queue of
+   chunks; stream returned by open_input hands them out in order, so the
+   rest of program sees an ordinary (non-seekable) file and converts rows
+   while decompression goes on.
+
+   End of gzip member is known only after decompression.  Parts start at
+   gzip headers found in the file whose first deflate block decodes, and
+   a part is used only if the previous one ends exactly there; otherwise
+   (header-like bytes inside compressed data) work is restarted from the
+   real end.  At most UNPACK_GUESSES parts are planned at once, the rest
+   is found when the plan is used up. */
+
+#define UNPACK_CHUNK	(256*1024)
+#define UNPACK_QUEUE	8		/* max chunks waiting in one part */
+#define UNPACK_THREADS	16
+#define UNPACK_GUESSES	32		/* speculative gzip parts in one plan */
+#define UNPACK_PROBE	4096	/* compressed bytes decoded to verify member */
+
+enum {
+	FORMAT_PLAIN,
+	FORMAT_GZIP,
+	FORMAT_ZSTD
+};
+
+struct chunk {
+	struct chunk *next;
+	size_t   size;
+	uint8_t  data[UNPACK_CHUNK];
+};
+
+struct part {
+	size_t   offset;		/* in compressed file */
+	size_t   length;		/* compressed size */
+	size_t   end;			/* where part really ended (gzip) */
+	struct chunk *head;		/* decompressed data */
+	struct chunk *tail;
+	int      queued;		/* chunks in queue */
+	bool     taken;			/* worker started */
+	bool     finished;		/* worker is done with part */
+	bool     failed;
+	bool     cancel;		/* result is not needed */
+};
+
+struct unpacker {
+	int      format;
+	uint8_t *src;			/* mapped file */
+	size_t   size;
+
+	struct part **parts;
+	int      nparts;
+	int      current;		/* part being read */
+	size_t   pos;			/* position in its first chunk */
+	int      window;		/* parts decompressed ahead of reader */
+	bool     stop;
+
+	pthread_t threads[UNPACK_THREADS];
+	int       nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+};
+
+/* checks if there is a gzip member header */
+bool gzip_header(uint8_t *p, size_t n) {
+	return n >= 18 && p[0] == 0x1f && p[1] == 0x8b &&
+	       p[2] == 8 &&				/* deflate */
+	       (p[3] & 0xe0) == 0 &&	/* reserved flags */
+	       (p[9] <= 13 || p[9] == 255);	/* OS */
+}
+
+/* checks header and decodes a few kB -- bytes 1f 8b 08 inside
+   compressed data almost never start a valid deflate stream */
+bool gzip_member(uint8_t *p, size_t n) {
+	uint8_t  out[32*1024];
+	z_stream z;
+	int ret;
+
+	if (!gzip_header(p, n))
+		return false;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+		return false;
+
+	z.next_in  = p;
+	z.avail_in = n < UNPACK_PROBE ? n : UNPACK_PROBE;
+	do {
+		z.next_out  = out;
+		z.avail_out = sizeof(out);
+		ret = inflate(&z, Z_NO_FLUSH);
+	} while (ret == Z_OK && z.avail_in > 0);
+	inflateEnd(&z);
+
+	/* Z_BUF_ERROR: fine so far, just needs more input */
+	return ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR;
+}
+
+bool unpack_add(struct unpacker *u, size_t offset, size_t length) {
+	struct part **parts, *p;
+
+	parts = (struct part**)realloc(u->parts, (u->nparts + 1) * sizeof(struct part*));
+	if (parts == NULL)
+		return false;
+	u->parts = parts;
+
+	p = (struct part*)calloc(1, sizeof(struct part));
+	if (p == NULL)
+		return false;
+	p->offset = offset;
+	p->length = length;
+	u->parts[u->nparts++] = p;
+	return true;
+}
+
+void unpack_free_part(struct part *p) {
+	struct chunk *c;
+
+	while (p->head) {
+		c = p->head;
+		p->head = c->next;
+		free(c);
+	}
+	free(p);
+}
+
+/* splits data from offset into parts; false on error */
+bool unpack_plan(struct unpacker *u, size_t offset) {
+	uint8_t *q;
+	size_t  n;
+	int     guesses = 0;
+
+	u->nparts  = 0;
+	u->current = 0;
+	u->pos     = 0;
+
+	if (u->format == FORMAT_GZIP) {
+		if (!unpack_add(u, offset, u->size - offset))
+			return false;
+
+		/* candidates for next members */
+		for (n = offset + 1; n < u->size && guesses < UNPACK_GUESSES; n = q - u->src + 1) {
+			q = memchr(u->src + n, 0x1f, u->size - n);
+			if (q == NULL)
+				break;
+			if (gzip_member(q, u->src + u->size - q)) {
+				if (!unpack_add(u, q - u->src, u->src + u->size - q))
+					return false;
+				guesses++;
+			}
+		}
+		return true;
+	}
+
+	while (offset < u->size) {
+#ifdef HAVE_ZSTD
+		n = ZSTD_findFrameCompressedSize(u->src + offset, u->size - offset);
+		if (ZSTD_isError(n))	/* decompression reports error */
+			n = u->size - offset;
+#else
+		n = u->size - offset;
+#endif
+		if (!unpack_add(u, offset, n))
+			return false;
+		offset += n;
+	}
+	return true;
+}
+
+/* queues decompressed chunk; false if part is not needed anymore */
+bool unpack_put(struct unpacker *u, struct part *p, struct chunk *c) {
+	pthread_mutex_lock(&u->lock);
+	while (p->queued >= UNPACK_QUEUE && !p->cancel)
+		pthread_cond_wait(&u->cond, &u->lock);
+
+	if (p->cancel) {
+		pthread_mutex_unlock(&u->lock);
+		free(c);
+		return false;
+	}
+
+	c->next = NULL;
+	if (p->tail)
+		p->tail->next = c;
+	else
+		p->head = c;
+	p->tail = c;
+	p->queued++;
+	pthread_cond_broadcast(&u->cond);
+	pthread_mutex_unlock(&u->lock);
+	return true;
+}
+
+void unpack_gzip(struct unpacker *u, struct part *p) {
+	struct chunk *c;
+	z_stream z;
+	int ret;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+		p->failed = true;
+		return;
+	}
+
+	z.next_in  = u->src + p->offset;
+	z.avail_in = p->length > UINT_MAX ? UINT_MAX : p->length;
+	do {
+		c = (struct chunk*)malloc(sizeof(struct chunk));
+		if (c == NULL) {
+			p->failed = true;
+			break;
+		}
+
+		z.next_out  = c->data;
+		z.avail_out = UNPACK_CHUNK;
+		ret = inflate(&z, Z_NO_FLUSH);
+		c->size = UNPACK_CHUNK - z.avail_out;
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			free(c);
+			p->failed = true;
+			break;
+		}
+
+		if (c->size == 0)
+			free(c);
+		else if (!unpack_put(u, p, c))
+			break;
+	} while (ret != Z_STREAM_END);
+
+	p->end = z.next_in - u->src;
+	inflateEnd(&z);
+}
+
+void unpack_zstd(struct unpacker *u, struct part *p) {
+#ifdef HAVE_ZSTD
+	ZSTD_DStream  *zs;
+	ZSTD_inBuffer  in;
+	ZSTD_outBuffer out;
+	struct chunk *c;
+	size_t ret;
+
+	zs = ZSTD_createDStream();
+	if (zs == NULL || ZSTD_isError(ZSTD_initDStream(zs))) {
+		ZSTD_freeDStream(zs);
+		p->failed = true;
+		return;
+	}
+
+	in.src  = u->src + p->offset;
+	in.size = p->length;
+	in.pos  = 0;
+	do {
+		c = (struct chunk*)malloc(sizeof(struct chunk));
+		if (c == NULL) {
+			p->failed = true;
+			break;
+		}
+
+		out.dst  = c->data;
+		out.size = UNPACK_CHUNK;
+		out.pos  = 0;
+		ret = ZSTD_decompressStream(zs, &out, &in);
+		c->size = out.pos;
+		if (ZSTD_isError(ret) || (ret != 0 && in.pos == in.size && out.pos == 0)) {
+			free(c);		/* corrupted or truncated frame */
+			p->failed = true;
+			break;
+		}
+
+		if (c->size == 0)
+			free(c);
+		else if (!unpack_put(u, p, c))
+			break;
+	} while (ret != 0);
+
+	ZSTD_freeDStream(zs);
+#else
+	(void)u;
+	p->failed = true;	/* compile with -DHAVE_ZSTD -lzstd */
+#endif
+}
+
+void *unpack_thread(void *arg) {
+	struct unpacker *u = (struct unpacker*)arg;
+	struct part *p;
+	int i;
+
+	pthread_mutex_lock(&u->lock);
+	while (!u->stop) {
+		/* the first waiting part, not too far ahead of reader */
+		p = NULL;
+		for (i = u->current; i < u->nparts && i < u->current + u->window; i++)
+			if (!u->parts[i]->taken) {
+				p = u->parts[i];
+				break;
+			}
+
+		if (p == NULL) {
+			pthread_cond_wait(&u->cond, &u->lock);
+			continue;
+		}
+
+		p->taken = true;
+		pthread_mutex_unlock(&u->lock);
+
+		if (u->format == FORMAT_GZIP)
+			unpack_gzip(u, p);
+		else
+			unpack_zstd(u, p);
+
+		pthread_mutex_lock(&u->lock);
+		p->finished = true;
+		pthread_cond_broadcast(&u->cond);
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	return NULL;
+}
+
+/* drops parts from current one (lock is held) */
+void unpack_cancel(struct unpacker *u) {
+	int i;
+
+	for (i = u->current; i < u->nparts; i++)
+		u->parts[i]->cancel = true;
+	pthread_cond_broadcast(&u->cond);
+
+	for (i = u->current; i < u->nparts; i++) {
+		while (u->parts[i]->taken && !u->parts[i]->finished)
+			pthread_cond_wait(&u->cond, &u->lock);
+		unpack_free_part(u->parts[i]);
+	}
+	u->nparts = u->current;
+}
+
+ssize_t unpack_read(void *cookie, char *buf, size_t size) {
+	struct unpacker *u = (struct unpacker*)cookie;
+	struct part  *p;
+	struct chunk *c;
+	size_t n, end;
+
+	pthread_mutex_lock(&u->lock);
+	while (u->current < u->nparts) {
+		p = u->parts[u->current];
+
+		if (p->head) {
+			/* workers only append, so chunk can be copied unlocked */
+			c = p->head;
+			pthread_mutex_unlock(&u->lock);
+
+			n = c->size - u->pos;
+			if (n > size)
+				n = size;
+			memcpy(buf, &c->data[u->pos], n);
+			u->pos += n;
+
+			pthread_mutex_lock(&u->lock);
+			if (u->pos == c->size) {
+				p->head = c->next;
+				if (p->head == NULL)
+					p->tail = NULL;
+				p->queued--;
+				u->pos = 0;
+				free(c);
+				pthread_cond_broadcast(&u->cond);
+			}
+			pthread_mutex_unlock(&u->lock);
+			return n;
+		}
+
+		if (!p->finished) {
+			pthread_cond_wait(&u->cond, &u->lock);
+			continue;
+		}
+
+		if (p->failed) {
+			pthread_mutex_unlock(&u->lock);
+			errno = EIO;
+			return -1;
+		}
+
+		/* part done -- gzip: the next one must start where it ended */
+		end = p->end;
+		u->current++;
+		unpack_free_part(p);
+		u->parts[u->current - 1] = NULL;
+		pthread_cond_broadcast(&u->cond);	/* window moved */
+
+		if (u->format == FORMAT_GZIP && end < u->size &&
+		    (u->current == u->nparts || u->parts[u->current]->offset != end)) {
+			unpack_cancel(u);
+			/* trailing garbage (e.g. zero padding) is ignored */
+			if (gzip_header(u->src + end, u->size - end)) {
+				free(u->parts);
+				u->parts = NULL;
+				if (!unpack_plan(u, end)) {
+					pthread_mutex_unlock(&u->lock);
+					errno = ENOMEM;
+					return -1;
+				}
+				pthread_cond_broadcast(&u->cond);
+			}
+		}
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	return 0;
+}
+
+int unpack_close(void *cookie) {
+	struct unpacker *u = (struct unpacker*)cookie;
+	int i;
+
+	pthread_mutex_lock(&u->lock);
+	u->stop = true;
+	unpack_cancel(u);
+	pthread_mutex_unlock(&u->lock);
+
+	for (i=0; i < u->nthreads; i++)
+		pthread_join(u->threads[i], NULL);
+
+	free(u->parts);
+	munmap(u->src, u->size);
+	pthread_mutex_destroy(&u->lock);
+	pthread_cond_destroy(&u->cond);
+	free(u);
+	return 0;
+}
+
+FILE *open_input(char *filename) {
+	cookie_io_functions_t io = {unpack_read, NULL, NULL, unpack_close};
+	struct unpacker *u;
+	struct stat st;
+	uint8_t magic[4];
+	FILE *f;
+	int  format, n, fd;
+
+	f = fopen(filename, "rb");
+	if (f == NULL)
+		return NULL;
+
+	/* detect format (pipes & devices are read as they are) */
+	fd = fileno(f);
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    pread(fd, magic, 4, 0) != 4) {
+		errno = 0;
+		return f;
+	}
+
+	if (magic[0] == 0x1f && magic[1] == 0x8b)
+		format = FORMAT_GZIP;
+	else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		format = FORMAT_ZSTD;
+	else
+		return f;
+
+#ifndef HAVE_ZSTD
+	if (format == FORMAT_ZSTD) {
+		fclose(f);
+		errno = EPROTONOSUPPORT;	/* compile with -DHAVE_ZSTD -lzstd */
+		return NULL;
+	}
+#endif
+
+	u = (struct unpacker*)calloc(1, sizeof(struct unpacker));
+	if (u == NULL) {
+		fclose(f);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	u->format = format;
+	u->size   = st.st_size;
+	u->src    = mmap(NULL, u->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	fclose(f);
+	if (u->src == MAP_FAILED) {
+		free(u);
+		return NULL;
+	}
+	madvise(u->src, u->size, MADV_WILLNEED);
+
+	pthread_mutex_init(&u->lock, NULL);
+	pthread_cond_init(&u->cond, NULL);
+	if (!unpack_plan(u, 0)) {
+		unpack_close(u);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* thread per part (at most one per processor) */
+	n = processors();
+	if (n > u->nparts)       n = u->nparts;
+	if (n > UNPACK_THREADS)  n = UNPACK_THREADS;
+	if (n < 1)               n = 1;
+	u->window = 2*n;
+	for (u->nthreads = 0; u->nthreads < n; u->nthreads++)
+		if (pthread_create(&u->threads[u->nthreads], NULL, unpack_thread, u) != 0)
+			break;
+
+	if (u->nthreads == 0) {
+		unpack_close(u);
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	f = fopencookie(u, "rb", io);
+	if (f == NULL) {
+		unpack_close(u);
+		errno = ENOMEM;
+		return NULL;
+	}
+	errno = 0;
+	return f;
+}
+
+/* transforms ******************************************************/
+
+/* Rotation & mirroring.  Rows of 1-bit images are blocks bytes long, the
+   leftmost pixel is the most significant bit and bits past width are
+   padding.  Rotation by 90 (270) degrees is a transposition followed by
+   left-right (top-bottom) mirror.  Transposition works on 8x8 bit tiles
+   (16x8 with SSE2) and goes through the image in bands of 64 columns of
+   tiles, so transposed rows being filled stay in cache. */
+
+#define TRANSPOSE_BAND	64		/* blocks */
+
+/* transposes 8x8 bit matrix; row 0 is the most significant byte */
+static inline uint64_t transpose8x8(uint64_t x) {
+	uint64_t t;
+
+	t = (x ^ (x >> 7))  & 0x00aa00aa00aa00aaULL; x ^= t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL; x ^= t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL; x ^= t ^ (t << 28);
+	return x;
+}
+
+/* reverses order of all 64 bits (i.e. bytes and bits in bytes) */
+static inline uint64_t reverse_bits(uint64_t x) {
+	x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+	x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+	x = ((x >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((x & 0x0f0f0f0f0f0f0f0fULL) << 4);
+	return __builtin_bswap64(x);
+}
+
+/* dst has width rows, (height+7)/8 bytes each */
+void transpose_bitmap(uint8_t *dst, uint8_t *src, int width, int height) {
+	int blocks     = (width + 7)/8;
+	int dst_blocks = (height + 7)/8;
+	int band, end, bx, y, k, rows;
+	uint8_t *s, *d;
+	uint64_t x;
+#ifdef __SSE2__
+	__m128i v;
+	int m;
+#endif
+
+	for (band = 0; band < blocks; band += TRANSPOSE_BAND) {
+		end = band + TRANSPOSE_BAND < blocks ? band + TRANSPOSE_BAND : blocks;
+		y   = 0;
+#ifdef __SSE2__
+		/* 16 rows: movemask gathers the most significant bits */
+		for (; y + 16 <= height; y += 16)
+			for (bx = band; bx < end; bx++) {
+				s = &src[y*blocks + bx];
+				v = _mm_setr_epi8(
+					s[ 7*blocks], s[ 6*blocks], s[ 5*blocks], s[ 4*blocks],
+					s[ 3*blocks], s[ 2*blocks], s[ 1*blocks], s[ 0*blocks],
+					s[15*blocks], s[14*blocks], s[13*blocks], s[12*blocks],
+					s[11*blocks], s[10*blocks], s[ 9*blocks], s[ 8*blocks]);
+				d    = &dst[bx*8*dst_blocks + y/8];
+				rows = width - bx*8 < 8 ? width - bx*8 : 8;
+				for (k=0; k < rows; k++) {
+					m = _mm_movemask_epi8(v);
+					d[0] = m;
+					d[1] = m >> 8;
+					d   += dst_blocks;
+					v    = _mm_add_epi8(v, v);
+				}
+			}
+#endif
+		/* 8 rows (last ones are zero-padded) */
+		for (; y < height; y += 8)
+			for (bx = band; bx < end; bx++) {
+				s = &src[y*blocks + bx];
+				x = 0;
+				for (k=0; k < 8 && y + k < height; k++)
+					x |= (uint64_t)s[k*blocks] << (56 - 8*k);
+				x    = transpose8x8(x);
+				d    = &dst[bx*8*dst_blocks + y/8];
+				rows = width - bx*8 < 8 ? width - bx*8 : 8;
+				for (k=0; k < rows; k++)
+					d[k*dst_blocks] = x >> (56 - 8*k);
+			}
+	}
+}
+
+/* mirrors rows left-right; tmp -- buffer for a row */
+void mirror_bitmap(uint8_t *img, int width, int height, uint8_t *tmp) {
+	int blocks = (width + 7)/8;
+	int pad    = blocks*8 - width;
+	uint8_t *row;
+	uint64_t x;
+	int y, i;
+
+	for (y=0, row=img; y < height; y++, row += blocks) {
+		/* reversed row, 8 bytes at once */
+		for (i=0; i + 8 <= blocks; i += 8) {
+			memcpy(&x, &row[blocks - 8 - i], 8);
+			x = reverse_bits(x);
+			memcpy(&tmp[i], &x, 8);
+		}
+		for (; i < blocks; i++)
+			tmp[i] = reverse_bits(row[blocks - 1 - i]) >> 56;
+
+		/* padding went to the left side -- shift it out */
+		if (pad == 0)
+			memcpy(row, tmp, blocks);
+		else {
+			for (i=0; i < blocks - 1; i++)
+				row[i] = (tmp[i] << pad) | (tmp[i + 1] >> (8 - pad));
+			row[i] = tmp[i] << pad;
+		}
+	}
+}
+
+/* mirrors rows top-bottom */
+void flip_bitmap(uint8_t *img, int blocks, int height, uint8_t *tmp) {
+	uint8_t *top, *bottom;
+
+	top    = img;
+	bottom = &img[(height - 1) * blocks];
+	for (; top < bottom; top += blocks, bottom -= blocks) {
+		memcpy(tmp, top, blocks);
+		memcpy(top, bottom, blocks);
+		memcpy(bottom, tmp, blocks);
+	}
+}
+
+bool transform_bitmap(uint8_t *dst, uint8_t *img, int width, int height, int op) {
+	uint8_t *out, *tmp;
+	uint8_t mask;
+	bool    ones;
+	int     blocks, y, t;
+
+	blocks = (width + 7)/8;
+
+	/* padding bits are zero, unless image was inverted */
+	mask = 0xff >> (width & 7);
+	ones = (width & 7) && (img[blocks - 1] & mask) == mask;
+
+	tmp = (uint8_t*)malloc(blocks > height ? blocks : height);
+	if (tmp == NULL)
+		return false;
+
+	out = img;
+	switch (op) {
+		case TRANSFORM_ROTATE_90:
+		case TRANSFORM_ROTATE_270:
+			out = dst;
+			transpose_bitmap(out, img, width, height);
+			if (op == TRANSFORM_ROTATE_90)
+				mirror_bitmap(out, height, width, tmp);
+			else
+				flip_bitmap(out, (height + 7)/8, width, tmp);
+
+			t      = width;
+			width  = height;
+			height = t;
+			break;
+		case TRANSFORM_ROTATE_180:
+			mirror_bitmap(out, width, height, tmp);
+			flip_bitmap(out, blocks, height, tmp);
+			break;
+		case TRANSFORM_MIRROR:
+			mirror_bitmap(out, width, height, tmp);
+			break;
+		case TRANSFORM_FLIP:
+			flip_bitmap(out, blocks, height, tmp);
+			break;
+	}
+	free(tmp);
+
+	if (ones && (width & 7)) {
+		blocks = (width + 7)/8;
+		mask   = 0xff >> (width & 7);
+		for (y=0; y < height; y++)
+			out[y*blocks + blocks - 1] |= mask;
+	}
+
+	return true;
+}
+
+int parse_transforms(char *arg, int *ops) {
+	char *op;
+	int  n = 0;
+
+	for (op = strtok(arg, ","); op; op = strtok(NULL, ",")) {
+		if (n == MAX_TRANSFORMS)
+			return -1;
+
+		if (strcmp(op, "90") == 0)
+			ops[n++] = TRANSFORM_ROTATE_90;
+		else if (strcmp(op, "180") == 0)
+			ops[n++] = TRANSFORM_ROTATE_180;
+		else if (strcmp(op, "270") == 0)
+			ops[n++] = TRANSFORM_ROTATE_270;
+		else if (strcmp(op, "h") == 0)
+			ops[n++] = TRANSFORM_MIRROR;
+		else if (strcmp(op, "v") == 0)
+			ops[n++] = TRANSFORM_FLIP;
+		else
+			return -1;
+	}
+	return n > 0 ? n : -1;
+}
+
+/* batch ***********************************************************/
+
+/* Batch conversion.  Files are sorted by size and dealt to workers (one
+   per processor), the largest first.  Worker takes jobs from the head of
+   its queue and when the queue is empty steals from the tail of others,
+   so small files fill gaps left by the large ones.  Threads of one image
+   (bands, decompression) share processors with other busy workers, so
+   the last large file gets all of them.
+
+   Files found in directory arguments keep their place in the tree under
+   output directory (dir/a/x.pgm -> out/dir/a/x.pbm).  Files whose output
+   names are equal (x.pgm & x.pgm.gz) are not converted at all. */
+
+int processors() {
+	int n, busy;
+
+	n    = sysconf(_SC_NPROCESSORS_ONLN);
+	busy = __atomic_load_n(&batch_busy, __ATOMIC_RELAXED);
+	if (busy > 1)
+		n /= busy;
+
+	return n < 1 ? 1 : n;
+}
+
+/* larger files first */
+int job_compare(const void *a, const void *b) {
+	off_t sa = ((struct job*)a)->size;
+	off_t sb = ((struct job*)b)->size;
+
+	return (sa < sb) - (sa > sb);
+}
+
+void batch_add(char *path, char *name) {
+	struct dirent *entry;
+	struct stat st;
+	DIR  *dir;
+	char *sub, *sub_name;
+
+	if (stat(path, &st) < 0) {
+		printf("%s: %s\n", path, strerror(errno));
+		errno = 0;
+		batch_errors++;
+		return;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		if (st.st_dev == batch_dev && st.st_ino == batch_ino)
+			return;
+
+		dir = opendir(path);
+		if (dir == NULL) {
+			printf("%s: %s\n", path, strerror(errno));
+			errno = 0;
+			batch_errors++;
+			return;
+		}
+		while ((entry = readdir(dir)) != NULL) {
+			if (entry->d_name[0] == '.')
+				continue;
+			if (asprintf(&sub, "%s/%s", path, entry->d_name) < 0 ||
+			    asprintf(&sub_name, "%s%s%s", name, *name ? "/" : "",
+			             entry->d_name) < 0)
+				error("malloc failed (batch)");
+			batch_add(sub, sub_name);
+			free(sub);
+			free(sub_name);
+		}
+		closedir(dir);
+		errno = 0;
+		return;
+	}
+
+	if ((njobs & (njobs - 1)) == 0) {
+		jobs = (struct job*)realloc(jobs, (njobs ? 2*njobs : 16) * sizeof(struct job));
+		if (jobs == NULL)
+			error("malloc failed (batch)");
+	}
+
+	jobs[njobs].path   = strdup(path);
+	jobs[njobs].out    = batch_output(name, batch_ext);
+	jobs[njobs].size   = st.st_size;
+	jobs[njobs].pixels = 0.0;
+	jobs[njobs].info[0] = 0;
+	jobs[njobs].clash  = false;
+	if (jobs[njobs].path == NULL || jobs[njobs].out == NULL)
+		error("malloc failed (batch)");
+	njobs++;
+}
+
+int job_out_compare(const void *a, const void *b) {
+	return strcmp((*(struct job**)a)->out, (*(struct job**)b)->out);
+}
+
+void batch_clashes() {
+	struct job **sorted;
+	int i, j, k;
+
+	sorted = (struct job**)malloc(njobs * sizeof(struct job*));
+	if (sorted == NULL)
+		error("malloc failed (batch)");
+	for (i=0; i < njobs; i++)
+		sorted[i] = &jobs[i];
+	qsort(sorted, njobs, sizeof(struct job*), job_out_compare);
+
+	for (i=0; i < njobs; i = j) {
+		for (j = i + 1; j < njobs && strcmp(sorted[i]->out, sorted[j]->out) == 0; j++)
+			;
+		if (j - i > 1)
+			for (k = i; k < j; k++) {
+				sorted[k]->clash = true;
+				printf("%s: output %s is shared by %d files, not converted\n",
+				       sorted[k]->path, sorted[k]->out, j - i);
+			}
+	}
+	free(sorted);
+}
+
+int batch_take(struct worker *w) {
+	struct worker *victim;
+	int i, k;
+
+	pthread_mutex_lock(&w->lock);
+	i = w->head < w->tail ? w->queue[w->head++] : -1;
+	pthread_mutex_unlock(&w->lock);
+	if (i >= 0)
+		return i;
+
+	for (k=1; k < nworkers; k++) {
+		victim = &workers[(w->id + k) % nworkers];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail)
+			i = victim->queue[--victim->tail];
+		pthread_mutex_unlock(&victim->lock);
+		if (i >= 0) {
+			w->steals++;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+char *batch_name(char *path) {
+	char *start, *end;
+	int  n;
+
+	end = path + strlen(path);
+	while (end > path + 1 && end[-1] == '/')
+		end--;
+	for (start = end; start > path && start[-1] != '/'; start--)
+		;
+
+	n = end - start;
+	if (n == 0 || strncmp(start, ".", n) == 0 || strncmp(start, "..", n) == 0)
+		return strdup("");
+	return strndup(start, n);
+}
+
+char *batch_output(char *name, char *ext) {
+	char *base, *dot, *out;
+	int  n;
+
+	base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	n    = strlen(name);
+
+	if (n > 3 && strcmp(name + n - 3, ".gz") == 0)
+		n -= 3;
+	else if (n > 4 && strcmp(name + n - 4, ".zst") == 0)
+		n -= 4;
+	dot = memrchr(base, '.', name + n - base);
+	if (dot && dot > base)
+		n = dot - name;
+
+	if (asprintf(&out, "%s/%.*s%s", batch_dir, n, name, ext) < 0)
+		return NULL;
+	return out;
+}
+
+bool batch_mkdirs(char *out) {
+	char *slash;
+
+	for (slash = strchr(out + strlen(batch_dir) + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = 0;
+		if (mkdir(out, 0777) < 0 && errno != EEXIST) {
+			snprintf(error_msg, sizeof(error_msg), "%s: %s", out, strerror(errno));
+			*slash = '/';
+			errno  = 0;
+			return false;
+		}
+		*slash = '/';
+	}
+	errno = 0;
+	return true;
+}
+
+void *batch_worker(void *arg) {
+	struct worker *w = (struct worker*)arg;
+	struct job *job;
+	char   *tmp;
+	FILE   *f;
+	double t;
+	bool   ok;
+	int    i, fd;
+
+	while ((i = batch_take(w)) >= 0) {
+		job = &jobs[i];
+		__atomic_add_fetch(&batch_busy, 1, __ATOMIC_RELAXED);
+		t = now_ms();
+
+		/* written under unique temporary name, so no half-written file
+		   is left and workers don't share it */
+		tmp = NULL;
+		f   = NULL;
+		if (asprintf(&tmp, "%s.XXXXXX", job->out) < 0) {
+			tmp = NULL;
+			snprintf(error_msg, sizeof(error_msg), "malloc failed (batch)");
+		}
+		else if (batch_mkdirs(tmp)) {
+			fd = mkstemp(tmp);
+			if (fd >= 0) {
+				fchmod(fd, batch_mode);	/* mkstemp creates it 0600 */
+				f = fdopen(fd, "wb");
+			}
+			if (f == NULL) {
+				snprintf(error_msg, sizeof(error_msg), "%s: %s", tmp, strerror(errno));
+				errno = 0;
+				if (fd >= 0) {
+					close(fd);
+					unlink(tmp);
+				}
+			}
+		}
+
+		if (f) {
+			/* failed only because other workers held the memory */
+			arena_blocked = false;
+			while (!(ok = batch_fn(job, f)) && arena_retry()) {
+				rewind(f);
+				if (ftruncate(fileno(f), 0) < 0)
+					break;
+			}
+			if (fclose(f) != 0 && ok) {
+				snprintf(error_msg, sizeof(error_msg), "%s: %s", tmp, strerror(errno));
+				errno = 0;
+				ok = false;
+			}
+
+			if (!ok)
+				unlink(tmp);
+			else if (rename(tmp, job->out) < 0) {
+				snprintf(error_msg, sizeof(error_msg), "%s: %s", job->out, strerror(errno));
+				errno = 0;
+				unlink(tmp);
+				ok = false;
+			}
+			if (!ok)
+				job->pixels = 0.0;
+		}
+
+		__atomic_sub_fetch(&batch_busy, 1, __ATOMIC_RELAXED);
+		t = now_ms() - t;
+
+		if (job->pixels > 0.0)
+			printf("%s -> %s: %s, %.1f ms, %.1f Mpix/s, %.1f MB/s\n",
+			       job->path, job->out, job->info, t,
+			       job->pixels / t / 1000.0, job->size / t / 1000.0);
+		else
+			printf("%s: %s\n", job->path, error_msg);
+
+		free(tmp);
+	}
+
+	return NULL;
+}
+
+int batch(char *dir, char **paths, int n, char *ext, batch_convert convert) {
+	struct stat st;
+	double t, pixels, bytes;
+	char   *name;
+	int    i, k, done, steals, todo;
+
+	batch_ext  = ext;
+	batch_fn   = convert;
+	batch_mode = umask(0);
+	umask(batch_mode);
+	batch_mode = 0666 & ~batch_mode;
+
+	if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		printf("%s: not a directory\n", dir);
+		return 1;
+	}
+	batch_dev = st.st_dev;
+	batch_ino = st.st_ino;
+
+	for (i=0; i < n; i++) {
+		name = batch_name(paths[i]);
+		if (name == NULL)
+			error("malloc failed (batch)");
+		batch_add(paths[i], name);
+		free(name);
+	}
+	if (njobs == 0) {
+		puts("No files to convert");
+		return 1;
+	}
+	batch_clashes();
+
+	/* deal jobs, the largest first */
+	qsort(jobs, njobs, sizeof(struct job), job_compare);
+
+	for (todo = i = 0; i < njobs; i++)
+		if (!jobs[i].clash)
+			todo++;
+	if (todo == 0) {
+		puts("No files to convert");
+		return 1;
+	}
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers > todo) nworkers = todo;
+	if (nworkers < 1)    nworkers = 1;
+
+	workers = (struct worker*)calloc(nworkers, sizeof(struct worker));
+	if (workers == NULL)
+		error("malloc failed (batch)");
+	for (i=0; i < nworkers; i++) {
+		workers[i].id    = i;
+		workers[i].queue = (int*)malloc((njobs / nworkers + 1) * sizeof(int));
+		if (workers[i].queue == NULL)
+			error("malloc failed (batch)");
+		pthread_mutex_init(&workers[i].lock, NULL);
+	}
+	for (i = k = 0; i < njobs; i++)
+		if (!jobs[i].clash) {
+			workers[k % nworkers].queue[workers[k % nworkers].tail++] = i;
+			k++;
+		}
+
+	/* main thread is worker 0; if a thread can't be created, its queue
+	   is stolen by others */
+	t = now_ms();
+	for (i=1; i < nworkers; i++)
+		if (pthread_create(&workers[i].thread, NULL, batch_worker, &workers[i]) != 0)
+			workers[i].thread = 0;
+	batch_worker(&workers[0]);
+	for (i=1; i < nworkers; i++)
+		if (workers[i].thread)
+			pthread_join(workers[i].thread, NULL);
+	t = now_ms() - t;
+
+	/* summary */
+	pixels = bytes = 0.0;
+	done   = 0;
+	for (i=0; i < njobs; i++)
+		if (jobs[i].pixels > 0.0) {
+			pixels += jobs[i].pixels;
+			bytes  += jobs[i].size;
+			done++;
+		}
+
+	steals = 0;
+	for (i=0; i < nworkers; i++)
+		steals += workers[i].steals;
+
+	printf("%d files converted (%d failed), %.1f Mpix, %.1f MB read in %.2f s: "
+	       "%.1f Mpix/s, %.1f MB/s (%d threads, %d steals, %.1f MB images peak)\n",
+	       done, njobs - done + batch_errors,
+	       pixels / 1e6, bytes / 1e6, t / 1000.0,
+	       pixels / t / 1000.0, bytes / t / 1000.0, nworkers, steals,
+	       arena_peak / 1e6);
+
+	return done == njobs && batch_errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+/*
+	Code shared by fbi16 and fbi16_2: image storage, file input (reader
+	thread, parallel decompression), rotations of 1-bit images and batch
+	conversion
+
+	Wojciech Mua
+	wojciech_mula@poczta.onet.pl
+	license BSD
+*/
+
+#ifndef FBI16_COMMON_H
+#define FBI16_COMMON_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+typedef char bool;
+#define false 0
+#define true  1
+
+/* when not NULL, error() & halt_on_error() jump here instead of exit;
+   per thread, batch workers load images in parallel */
+extern __thread jmp_buf *recover;
+extern __thread char     error_msg[256];
+
+/* reports error and exits (see also recover); defined by program */
+void error(char*);
+void halt_on_error(char*);
+#define ordie halt_on_error
+
+/* monotonic clock in milliseconds */
+double now_ms();
+
+/* image storage: one zeroed, aligned arena per image, counted against
+   budget (arena_used, arena_budget) */
+#define ARENA_ALIGN		64			/* cache line (and SIMD loads) */
+#define ARENA_HEADER	ARENA_ALIGN	/* mapping length is stored in front */
+#define HUGE_PAGE_SIZE	(2*1024*1024)
+
+#define arena_round(n)	(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+extern size_t arena_used;			/* bytes mapped */
+extern size_t arena_peak;
+extern size_t arena_budget;			/* 0 -- no limit */
+extern pthread_mutex_t arena_lock;
+
+/* called when allocation doesn't fit into budget, should free size bytes
+   (fbi16 -- cache eviction); if NULL, budget is hard: arena_alloc waits
+   for other threads to free memory or fails (see arena_wait) */
+extern void (*arena_reclaim)(size_t size);
+
+void *arena_alloc(size_t size);
+void  arena_free(void *p);
+
+/* after failed allocation (hard budget): true if it failed only because
+   other threads hold memory and waits until they free some */
+bool  arena_retry();
+
+/* asynchronous reader (see reader_thread) */
+#define READER_CHUNKS		4
+#define READER_CHUNK_SIZE	(1024*1024)
+
+struct reader {
+	/* source: pread from fd or (if fd < 0) fread from f */
+	FILE    *f;
+	int      fd;
+	off_t    offset;
+	off_t    remaining;		/* bytes left to read */
+
+	uint8_t *chunk[READER_CHUNKS];
+	size_t   length[READER_CHUNKS];
+	int      filled;		/* number of chunks ready to use */
+	int      first;			/* the oldest filled chunk */
+	size_t   pos;			/* consumer position in the first chunk */
+	bool     done;			/* reader finished (EOF or error) */
+	bool     stop;			/* consumer doesn't need more data */
+
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	pthread_t       thread;
+};
+
+/* starts reading length bytes (from offset if fd >= 0); false on error */
+bool reader_open(struct reader *r, FILE *f, int fd, off_t offset, off_t length);
+
+/* returns next n bytes -- pointer into chunk or to buf, if data is
+   split between chunks; NULL on EOF/error */
+uint8_t *reader_next(struct reader *r, size_t n, uint8_t *buf);
+void reader_close(struct reader *r);
+
+/* opens file, compressed ones (gzip, zstd) are decompressed on the fly */
+FILE *open_input(char *filename);
+
+/* rotations & mirrors (option -r, keys) */
+enum {
+	TRANSFORM_ROTATE_90,	/* clockwise */
+	TRANSFORM_ROTATE_180,
+	TRANSFORM_ROTATE_270,
+	TRANSFORM_MIRROR,		/* left-right */
+	TRANSFORM_FLIP			/* top-bottom */
+};
+
+#define MAX_TRANSFORMS	8
+
+/* parses -r argument (list like "90,h") into ops, returns number of
+   transforms or -1 if invalid */
+int parse_transforms(char *arg, int *ops);
+
+/* rotates or mirrors 1-bit image; rotations by 90 and 270 degrees write
+   height x width image to dst, others work in place; false if out of
+   memory */
+bool transform_bitmap(uint8_t *dst, uint8_t *img, int width, int height, int op);
+
+/* batch conversion (option -b) */
+struct job {
+	char   *path;
+	char   *out;			/* output file */
+	bool    clash;			/* other job has the same output file */
+	off_t   size;			/* file size */
+	double  pixels;			/* converted image (0 -- failed) */
+	char    info[64];		/* printed after conversion (size, ...) */
+};
+
+/* converts job->path and writes result to f; sets job->pixels & info,
+   on error returns false (message is in error_msg) */
+typedef bool (*batch_convert)(struct job *job, FILE *f);
+
+extern char *batch_dir;		/* output directory */
+
+/* batch: converts files (directories are searched) to files with
+   extension ext placed in dir, nothing is displayed; returns exit
+   status */
+int batch(char *dir, char **paths, int n, char *ext, batch_convert convert);
+
+/* processors available for threads of one image (batch shares them
+   among busy workers) */
+int processors();
+
+#endif